@@ -18,10 +18,24 @@
 #include <linux/fcntl.h> /* O_ACCMODE */
 #include <linux/seq_file.h>
 #include <linux/cdev.h>
+#include <linux/log2.h> /* roundup_pow_of_two() */
+#include <linux/mm.h> /* kvmalloc() */
+#include <linux/vmalloc.h> /* vmalloc_user() */
+#include <linux/highmem.h> /* kmap_local_page() */
+#include <linux/pipe_fs_i.h>
+#include <linux/splice.h>
+#include <linux/sched/clock.h> /* local_clock() */
+#include <linux/sched/signal.h> /* signal_pending() */
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+#include <linux/percpu.h>
 #include <asm/uaccess.h> /* copy_*_user */
 
 #include "scullp.h"
 
+#define CREATE_TRACE_POINTS
+#include "scullp_trace.h"
+
 /*
  * Our parameters which can be set at load time.
  */
@@ -29,68 +43,1226 @@ int scull_p_major = SCULL_P_MAJOR;
 int scull_p_minor = 0;
 int scull_p_nr_devs = SCULL_P_NR_DEVS; /* number of bare scullp devices */
 int scull_p_buffer = SCULL_P_BUFFER; /* buffer size */
+int scull_p_max_buffer = SCULL_P_MAX_BUFFER; /* max size when resizing */
+int scull_p_spsc = 0; /* lockless single producer/single consumer pipes */
+int scull_p_shm = 0; /* SPSC pipes user space can mmap() */
+int scull_p_pages = 0; /* page ring pipes, which can splice */
+int scull_p_mq = 0; /* multi-queue pipes, one ring per cpu */
+int scull_p_records = 0; /* message pipes: one write, one read */
+int scull_p_bcast = 0; /* broadcast pipes: all readers get all the data */
+int scull_p_persist = 0; /* keep the data while nobody has the pipe open */
+int scull_p_lanes = 0; /* priority lanes per pipe, 0 or 1 for none */
+int scull_p_rcvlowat = 1; /* wake readers when this much is there */
+int scull_p_sndlowat = 1; /* wake writers when this much is free */
+int scull_p_flush_us = SCULL_P_FLUSH_US; /* unless data waits this long */
 
 module_param(scull_p_major, int, S_IRUGO);
 module_param(scull_p_minor, int, S_IRUGO);
 module_param(scull_p_nr_devs, int, S_IRUGO);
 module_param(scull_p_buffer, int, 0);
+module_param(scull_p_max_buffer, int, S_IRUGO | S_IWUSR);
+module_param(scull_p_spsc, int, S_IRUGO);
+module_param(scull_p_shm, int, S_IRUGO);
+module_param(scull_p_pages, int, S_IRUGO);
+module_param(scull_p_mq, int, S_IRUGO);
+module_param(scull_p_records, int, S_IRUGO);
+module_param(scull_p_bcast, int, S_IRUGO);
+module_param(scull_p_persist, int, S_IRUGO);
+module_param(scull_p_lanes, int, S_IRUGO);
+module_param(scull_p_rcvlowat, int, S_IRUGO);
+module_param(scull_p_sndlowat, int, S_IRUGO);
+module_param(scull_p_flush_us, int, S_IRUGO);
+
+MODULE_AUTHOR("Alessandro Rubini, Jonathan Corbet");
+MODULE_LICENSE("Dual BSD/GPL");
+
+static struct scull_pipe *scull_p_devices;
+
+static int spacefree(struct scull_pipe *dev);
+static int scull_getwritespace(struct scull_pipe *dev, struct file *filp,
+			       unsigned int need);
+static int scull_p_fasync(int fd, struct file *filp, int mode);
+static int scull_p_busy_poll(struct file *filp, size_t want);
+static int scull_p_bcast_advance(struct scull_pipe *dev);
+static void scull_p_wake_writers(struct scull_pipe *dev);
+
+/*
+ * Allocate the ring of a pipe, or free it with whatever is still in it.
+ * Called with the device semaphore held.
+ */
+static void scull_p_free_ring(struct scull_pipe *dev);
+
+/*
+ * The largest ring allowed. Rings are powers of two, so the limit is
+ * rounded down: rounding a size up must not take it past the cap.
+ */
+static unsigned int scull_p_max_ring(void)
+{
+	return rounddown_pow_of_two(max(READ_ONCE(scull_p_max_buffer), 2));
+}
+
+static int scull_p_alloc_ring(struct scull_pipe *dev)
+{
+	unsigned int size = roundup_pow_of_two(
+		clamp(scull_p_buffer, 2, (int)scull_p_max_ring()));
+	struct scull_p_queue *q;
+	struct scull_p_lane *l;
+	int cpu, i;
+
+	if (dev->buffer || dev->slots || dev->queues || dev->lanes[0].buffer)
+		return 0; /* already there */
+	if (dev->nlanes) {
+		dev->buffersize = size;
+		for (i = 0; i < dev->nlanes; i++) {
+			l = &dev->lanes[i];
+			l->buffer = kvmalloc(size, GFP_KERNEL);
+			if (!l->buffer) {
+				scull_p_free_ring(dev);
+				return -ENOMEM;
+			}
+			l->head = l->tail = 0;
+			l->credit = l->weight;
+			l->lat.mhead = l->lat.mtail = 0;
+		}
+	} else if (dev->mq) {
+		dev->buffersize = size;
+		dev->queues = alloc_percpu(struct scull_p_queue);
+		if (!dev->queues)
+			return -ENOMEM;
+		for_each_possible_cpu(cpu) {
+			q = per_cpu_ptr(dev->queues, cpu);
+			sema_init(&q->sem, 1);
+			init_waitqueue_head(&q->outq);
+			q->buffer = kvmalloc_node(size, GFP_KERNEL,
+						  cpu_to_node(cpu));
+			if (!q->buffer) {
+				scull_p_free_ring(dev);
+				return -ENOMEM;
+			}
+		}
+		dev->rr = 0;
+	} else if (dev->pages) {
+		dev->nslots = roundup_pow_of_two(max_t(unsigned int,
+			DIV_ROUND_UP(size, PAGE_SIZE), SCULL_P_MIN_SLOTS));
+		dev->slots = kvcalloc(dev->nslots, sizeof(*dev->slots),
+				      GFP_KERNEL);
+		if (!dev->slots)
+			return -ENOMEM;
+		dev->shead = dev->stail = 0;
+	} else if (dev->shm) {
+		/* zeroed, and mappable with remap_vmalloc_range() */
+		dev->hdr = vmalloc_user(PAGE_SIZE + size);
+		if (!dev->hdr)
+			return -ENOMEM;
+		dev->hdr->size = dev->buffersize = size;
+		dev->hdr->offset = PAGE_SIZE;
+		dev->buffer = (char *)dev->hdr + PAGE_SIZE;
+	} else {
+		if (dev->records)
+			size = max_t(unsigned int, size, 2 * SCULL_P_RECHDR);
+		dev->buffersize = size;
+		dev->buffer = kvmalloc(size, GFP_KERNEL);
+		if (!dev->buffer)
+			return -ENOMEM;
+	}
+	dev->head = dev->tail = 0; /* rd and wr from the beginning */
+	dev->lat.mhead = dev->lat.mtail = 0;
+	return 0;
+}
+
+static void scull_p_free_ring(struct scull_pipe *dev)
+{
+	int cpu, i;
+
+	for (i = 0; i < dev->nlanes; i++) {
+		kvfree(dev->lanes[i].buffer);
+		dev->lanes[i].buffer = NULL;
+	}
+	if (dev->queues) {
+		for_each_possible_cpu(cpu)
+			kvfree(per_cpu_ptr(dev->queues, cpu)->buffer);
+		free_percpu(dev->queues);
+		dev->queues = NULL;
+	}
+	if (dev->slots) {
+		for (; dev->stail != dev->shead; dev->stail++)
+			put_page(dev->slots[dev->stail & (dev->nslots - 1)].page);
+		kvfree(dev->slots);
+		dev->slots = NULL;
+	}
+	if (dev->hdr) {
+		vfree(dev->hdr); /* and the ring after it */
+		dev->hdr = NULL;
+	} else
+		kvfree(dev->buffer);
+	dev->buffer = NULL; /* the other fields are not checked on open */
+}
+
+static inline struct scull_pipe *scull_p_dev(struct file *filp)
+{
+	return ((struct scull_p_fd *)filp->private_data)->dev;
+}
+
+static int scull_p_open(struct inode *inode, struct file *filp)
+{
+	struct scull_pipe *dev;
+	struct scull_p_fd *pf;
+	int result = 0;
+
+	dev = container_of(inode->i_cdev, struct scull_pipe, cdev);
+	pf = kzalloc(sizeof(*pf), GFP_KERNEL);
+	if (!pf)
+		return -ENOMEM;
+	pf->dev = dev;
+	pf->lane = dev->nlanes ? dev->nlanes - 1 : 0; /* bulk by default */
+	filp->private_data = pf;
+
+	if (down_interruptible(&dev->sem)) {
+		result = -ERESTARTSYS;
+		goto fail;
+	}
+	/* shm pipes are opened read-write to be mapped: their users decide */
+	if (dev->spsc && !dev->shm &&
+	    (((filp->f_mode & FMODE_READ) && dev->nreaders) ||
+	     ((filp->f_mode & FMODE_WRITE) && dev->nwriters)))
+		result = -EBUSY; /* one reader and one writer at most */
+	else if (scull_p_alloc_ring(dev))
+		result = -ENOMEM;
+	if (result) {
+		up(&dev->sem);
+		goto fail;
+	}
+
+	/* use f_mode,not  f_flags: it's cleaner (fs/open.c tells why) */
+	if (dev->bcast && (filp->f_mode & FMODE_READ)) {
+		pf->tail = dev->tail; /* from the oldest data there */
+		list_add_tail(&pf->list, &dev->readers);
+	}
+	if (filp->f_mode & FMODE_READ)
+		dev->nreaders++;
+	if (filp->f_mode & FMODE_WRITE)
+		dev->nwriters++;
+	up(&dev->sem);
+
+	return nonseekable_open(inode, filp);
+
+fail:
+	kfree(pf);
+	return result;
+}
+
+static int scull_p_release(struct inode *inode, struct file *filp)
+{
+	struct scull_pipe *dev = scull_p_dev(filp);
+
+	struct scull_p_fd *pf = filp->private_data;
+
+	/* remove this filp from the asynchronously notified filp's */
+	scull_p_fasync(-1, filp, 0);
+	down(&dev->sem);
+	if (dev->bcast && (filp->f_mode & FMODE_READ)) {
+		list_del(&pf->list);
+		if (scull_p_bcast_advance(dev)) /* it may have been the slowest */
+			scull_p_wake_writers(dev);
+	}
+	if (filp->f_mode & FMODE_READ)
+		dev->nreaders--;
+	if (filp->f_mode & FMODE_WRITE)
+		dev->nwriters--;
+	if (pf->producer)
+		clear_bit(0, &dev->shm_wbusy);
+	if (dev->nreaders + dev->nwriters == 0) {
+		hrtimer_cancel(&dev->flush_timer);
+		dev->rflush = 0;
+		if (!dev->persist)
+			scull_p_free_ring(dev);
+	}
+	up(&dev->sem);
+	kfree(filp->private_data);
+	return 0;
+}
+
+/*
+ * Copy "count" bytes between user space and a ring of "size" bytes,
+ * starting at free running index "idx". Both segments are handled when
+ * the data wraps around the end of the buffer. Return nonzero if
+ * something faulted.
+ */
+static int scull_p_copy_out(char *ring, unsigned int size, char __user *buf,
+			    unsigned int idx, size_t count)
+{
+	unsigned int off = idx & (size - 1);
+	size_t first = min(count, (size_t)(size - off));
+
+	if (copy_to_user(buf, ring + off, first))
+		return -EFAULT;
+	if (first < count &&
+	    copy_to_user(buf + first, ring, count - first)) /* wrapped */
+		return -EFAULT;
+	return 0;
+}
+
+static int scull_p_copy_in(char *ring, unsigned int size,
+			   const char __user *buf, unsigned int idx,
+			   size_t count)
+{
+	unsigned int off = idx & (size - 1);
+	size_t first = min(count, (size_t)(size - off));
+
+	if (copy_from_user(ring + off, buf, first))
+		return -EFAULT;
+	if (first < count &&
+	    copy_from_user(ring, buf + first, count - first)) /* wrapped */
+		return -EFAULT;
+	return 0;
+}
+
+/*
+ * Statistics. The counters are per cpu, so that the lockless modes don't
+ * share a cache line just to count; whoever shows them sums them up.
+ */
+static void scull_p_kill_fasync(struct scull_pipe *dev)
+{
+	if (dev->async_queue) {
+		this_cpu_inc(dev->stats->fasync);
+		kill_fasync(&dev->async_queue, SIGIO, POLL_IN);
+	}
+}
+
+static int scull_p_eagain(struct scull_pipe *dev, int dir)
+{
+	this_cpu_inc(dev->stats->eagain[dir]);
+	return -EAGAIN;
+}
+
+static void scull_p_blocked(struct scull_pipe *dev, int dir, u64 t0)
+{
+	this_cpu_inc(dev->stats->blocked[dir]);
+	this_cpu_add(dev->stats->blocked_ns[dir], ktime_get_ns() - t0);
+}
+
+/* wait_event_interruptible(), accounted as time blocked */
+#define scull_p_wait(dev, dir, wq, condition)				\
+	({								\
+		u64 __t0 = ktime_get_ns();				\
+		int __ret = wait_event_interruptible(wq, condition);	\
+		scull_p_blocked(dev, dir, __t0);			\
+		__ret;							\
+	})
+
+/*
+ * Called by the producer of a ring before it publishes "head", its new
+ * index: the mark has to be there before the consumer can see the data
+ * it stands for.
+ */
+static void scull_p_mark(struct scull_p_delay *d, unsigned int head)
+{
+	unsigned int mhead = d->mhead;
+
+	if (mhead - smp_load_acquire(&d->mtail) == SCULL_P_MARKS) {
+		d->unmarked++; /* the consumer is far behind: don't sample */
+		return;
+	}
+	d->marks[mhead % SCULL_P_MARKS].idx = head;
+	d->marks[mhead % SCULL_P_MARKS].ns = ktime_get_ns();
+	smp_store_release(&d->mhead, mhead + 1);
+}
+
+/*
+ * Called by the consumer once the data up to "tail" is gone: every write
+ * that ended by then has waited from its mark until now.
+ */
+static void scull_p_unmark(struct scull_p_delay *d, unsigned int tail)
+{
+	unsigned int mtail = d->mtail, mhead, b;
+	struct scull_p_mark *mark;
+	u64 now = 0, usecs;
+
+	mhead = smp_load_acquire(&d->mhead);
+	for (; mtail != mhead; mtail++) {
+		mark = &d->marks[mtail % SCULL_P_MARKS];
+		if ((int)(mark->idx - tail) > 0)
+			break; /* not read yet */
+		if (!now)
+			now = ktime_get_ns();
+		usecs = div_u64(now - mark->ns, NSEC_PER_USEC);
+		b = usecs ? min_t(u64, ilog2(usecs) + 1, SCULL_P_HIST - 1) : 0;
+		d->hist[b]++;
+	}
+	smp_store_release(&d->mtail, mtail);
+}
+
+/*
+ * Called by the producer before it publishes "head", its new index, with
+ * "fill" bytes queued. In multi-queue mode there are many producers and
+ * in lane mode many rings, so no marks for the pipe as a whole.
+ */
+static void scull_p_enqueued(struct scull_pipe *dev, size_t n,
+			     unsigned int head, unsigned int fill)
+{
+	this_cpu_add(dev->stats->bytes[SCULL_P_WR], n);
+	this_cpu_inc(dev->stats->ops[SCULL_P_WR]);
+	if (fill > READ_ONCE(dev->hiwat))
+		WRITE_ONCE(dev->hiwat, fill); /* racy, but only ever grows */
+	trace_scullp_enqueue(dev - scull_p_devices, n, fill);
+
+	if (!dev->mq && !dev->nlanes && n)
+		scull_p_mark(&dev->lat, head);
+}
+
+/* Called by the consumer with the data up to "tail" gone */
+static void scull_p_dequeued(struct scull_pipe *dev, size_t n,
+			     unsigned int tail, unsigned int fill)
+{
+	this_cpu_add(dev->stats->bytes[SCULL_P_RD], n);
+	this_cpu_inc(dev->stats->ops[SCULL_P_RD]);
+	trace_scullp_dequeue(dev - scull_p_devices, n, fill);
+
+	if (!dev->mq && !dev->nlanes)
+		scull_p_unmark(&dev->lat, tail);
+}
+
+/*
+ * SPSC mode. Each side owns one index: it reads its own index plainly,
+ * acquires the other one before touching the data it guards, and
+ * releases its own after it is done with the data. The peer is woken
+ * only on the transitions it can be waiting for: empty to non-empty for
+ * the reader, full to non-full for the writer. The smp_mb() between
+ * publishing our index and looking at the peer's pairs with the one in
+ * the peer's prepare_to_wait(): either we see the index it went to sleep
+ * on, or it sees ours and doesn't sleep.
+ */
+static inline unsigned int *scull_p_headp(struct scull_pipe *dev)
+{
+	return dev->hdr ? &dev->hdr->head : &dev->head;
+}
+
+static inline unsigned int *scull_p_tailp(struct scull_pipe *dev)
+{
+	return dev->hdr ? &dev->hdr->tail : &dev->tail;
+}
+
+/*
+ * Wake the readers or the writers of an SPSC pipe. A shm pipe's flag is
+ * cleared first: a waiter that has yet to sleep sets it again.
+ */
+static void scull_p_wake(struct scull_pipe *dev, int dir)
+{
+	if (dir == SCULL_P_RD) {
+		if (dev->hdr)
+			WRITE_ONCE(dev->hdr->rwait, 0);
+		wake_up_interruptible_poll(&dev->inq, EPOLLIN | EPOLLRDNORM);
+	} else {
+		if (dev->hdr)
+			WRITE_ONCE(dev->hdr->wwait, 0);
+		wake_up_interruptible_poll(&dev->outq, EPOLLOUT | EPOLLWRNORM);
+	}
+}
+
+/*
+ * The wait condition of SPSC pipes: has the peer's index moved from
+ * "val"? On a shm pipe the peer may be in user space, so we first tell
+ * it, through our flag, that it has to wake us.
+ */
+static int scull_p_moved(struct scull_pipe *dev, unsigned int *idx,
+			 unsigned int val, int dir)
+{
+	if (dev->hdr) {
+		WRITE_ONCE(*(dir == SCULL_P_RD ? &dev->hdr->rwait :
+						 &dev->hdr->wwait), 1);
+		smp_mb(); /* pairs with the peer's, before it reads the flag */
+	}
+	return smp_load_acquire(idx) != val;
+}
+
+static ssize_t scull_p_spsc_read(struct scull_pipe *dev, struct file *filp,
+				 char __user *buf, size_t count)
+{
+	unsigned int *headp = scull_p_headp(dev), *tailp = scull_p_tailp(dev);
+	unsigned int tail = READ_ONCE(*tailp), head;
+	size_t done = 0, n;
+
+	for (;;) {
+		percpu_down_read(&dev->resize_sem);
+		head = smp_load_acquire(headp);
+		if (head != tail)
+			break;
+		percpu_up_read(&dev->resize_sem); /* nothing to read */
+		if (filp->f_flags & O_NONBLOCK)
+			return scull_p_eagain(dev, SCULL_P_RD);
+		if (scull_p_busy_poll(filp, 1))
+			continue;
+		PDEBUG("\"%s\" reading: going to sleep\n", current->comm);
+		if (scull_p_wait(dev, SCULL_P_RD, dev->inq,
+				 scull_p_moved(dev, headp, tail, SCULL_P_RD)))
+			return -ERESTARTSYS; /* signal: tell the fs layer to handle it */
+	}
+
+	/* drain what is there, and what the writer adds meanwhile */
+	do {
+		/* a shm peer could have left anything in the indices */
+		n = min3(count - done, (size_t)(head - tail),
+			 (size_t)dev->buffersize);
+		if (scull_p_copy_out(dev->buffer, dev->buffersize,
+				     buf + done, tail, n))
+			break;
+		smp_store_release(tailp, tail + n);
+		scull_p_dequeued(dev, n, tail + n, head - tail - n);
+
+		/*
+		 * Our writers only sleep on a full pipe, but a mapped one
+		 * may wait for any room at all: on shm pipes, the flag says.
+		 */
+		smp_mb();
+		head = smp_load_acquire(headp);
+		if ((head - tail == dev->buffersize && /* it was full */
+		     waitqueue_active(&dev->outq)) ||
+		    (dev->hdr && READ_ONCE(dev->hdr->wwait)))
+			scull_p_wake(dev, SCULL_P_WR);
+		tail += n;
+		done += n;
+	} while (done < count && head != tail);
+	percpu_up_read(&dev->resize_sem);
+
+	if (!done)
+		return -EFAULT; /* the first copy faulted */
+	PDEBUG("\"%s\" did read %li bytes\n", current->comm, (long)done);
+	return done;
+}
+
+static ssize_t scull_p_spsc_write(struct scull_pipe *dev, struct file *filp,
+				  const char __user *buf, size_t count)
+{
+	unsigned int *headp = scull_p_headp(dev), *tailp = scull_p_tailp(dev);
+	unsigned int head = READ_ONCE(*headp), tail, gen;
+	struct scull_p_fd *pf = filp->private_data;
+	size_t done = 0, n;
+
+	if (dev->shm && !pf->producer) {
+		if (test_and_set_bit(0, &dev->shm_wbusy))
+			return -EBUSY; /* our indices allow one producer */
+		pf->producer = 1;
+	}
+	for (;;) {
+		percpu_down_read(&dev->resize_sem);
+		tail = smp_load_acquire(tailp);
+		if (head - tail < dev->buffersize) /* anything else is full */
+			break;
+		gen = dev->resizes;
+		percpu_up_read(&dev->resize_sem); /* full */
+		if (filp->f_flags & O_NONBLOCK)
+			return scull_p_eagain(dev, SCULL_P_WR);
+		PDEBUG("\"%s\" writing: going to sleep\n", current->comm);
+		/* a bigger ring makes room without moving tail */
+		if (scull_p_wait(dev, SCULL_P_WR, dev->outq,
+				 scull_p_moved(dev, tailp, tail, SCULL_P_WR) ||
+				 READ_ONCE(dev->resizes) != gen))
+			return -ERESTARTSYS; /* signal: tell the fs layer to handle it */
+	}
+
+	/* fill the free space, and what the reader frees meanwhile */
+	do {
+		n = min(count - done, (size_t)(dev->buffersize - (head - tail)));
+		if (scull_p_copy_in(dev->buffer, dev->buffersize,
+				    buf + done, head, n))
+			break;
+		scull_p_enqueued(dev, n, head + n, head + n - tail);
+		smp_store_release(headp, head + n);
+
+		/* as in scull_p_spsc_read(): mapped readers wait for any head */
+		smp_mb();
+		tail = smp_load_acquire(tailp);
+		if ((tail == head && waitqueue_active(&dev->inq)) ||
+		    (dev->hdr && READ_ONCE(dev->hdr->rwait)))
+			scull_p_wake(dev, SCULL_P_RD);
+		if (tail == head) /* it was empty */
+			scull_p_kill_fasync(dev);
+		head += n;
+		done += n;
+	} while (done < count && head - tail < dev->buffersize);
+	percpu_up_read(&dev->resize_sem);
+
+	if (!done)
+		return -EFAULT; /* the first copy faulted */
+	PDEBUG("\"%s\" did write %li bytes\n", current->comm, (long)done);
+	return done;
+}
+
+/*
+ * Multi-queue mode. A writer only touches the queue of its cpu, a reader
+ * takes what it can from each queue in turn. Neither looks at anything
+ * shared unless the other side may be asleep: the smp_mb() after each
+ * update pairs with the one in prepare_to_wait(), as in SPSC mode, so
+ * the wait queues are only touched when somebody is on them.
+ */
+static int scull_p_mq_readable(struct scull_pipe *dev)
+{
+	struct scull_p_queue *q;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		q = per_cpu_ptr(dev->queues, cpu);
+		if (READ_ONCE(q->head) != READ_ONCE(q->tail))
+			return 1;
+	}
+	return 0;
+}
+
+static long scull_p_mq_fill(struct scull_pipe *dev)
+{
+	struct scull_p_queue *q;
+	long fill = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		q = per_cpu_ptr(dev->queues, cpu);
+		fill += READ_ONCE(q->head) - READ_ONCE(q->tail);
+	}
+	return fill;
+}
+
+static u64 scull_p_mq_mask(struct scull_pipe *dev)
+{
+	struct scull_p_queue *q;
+	u64 mask = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		if (cpu >= 64)
+			break;
+		q = per_cpu_ptr(dev->queues, cpu);
+		if (READ_ONCE(q->head) != READ_ONCE(q->tail))
+			mask |= 1ULL << cpu;
+	}
+	return mask;
+}
+
+static ssize_t scull_p_mq_read(struct scull_pipe *dev, struct file *filp,
+			       char __user *buf, size_t count)
+{
+	struct scull_p_queue *q;
+	unsigned int i, cpu;
+	size_t done = 0, n;
+	int faulted = 0;
+
+	if (down_interruptible(&dev->sem)) /* against other readers only */
+		return -ERESTARTSYS;
+	while (!scull_p_mq_readable(dev)) { /* nothing to read */
+		up(&dev->sem);
+		if (filp->f_flags & O_NONBLOCK)
+			return scull_p_eagain(dev, SCULL_P_RD);
+		if (!scull_p_busy_poll(filp, 1)) {
+			PDEBUG("\"%s\" reading: going to sleep\n", current->comm);
+			if (scull_p_wait(dev, SCULL_P_RD, dev->inq,
+					 scull_p_mq_readable(dev)))
+				return -ERESTARTSYS; /* signal: tell the fs layer to handle it */
+		}
+		if (down_interruptible(&dev->sem))
+			return -ERESTARTSYS;
+	}
+
+	/* one round over the queues, starting after the last one served */
+	for (i = 0; i < nr_cpu_ids && done < count && !faulted; i++) {
+		cpu = (dev->rr + i) % nr_cpu_ids;
+		if (!cpu_possible(cpu))
+			continue;
+		q = per_cpu_ptr(dev->queues, cpu);
+		if (READ_ONCE(q->head) == q->tail)
+			continue; /* don't take the lock of an empty queue */
+		if (down_interruptible(&q->sem))
+			break;
+		n = min(count - done, (size_t)(q->head - q->tail));
+		if (scull_p_copy_out(q->buffer, dev->buffersize, buf + done,
+				     q->tail, n)) {
+			faulted = 1;
+			n = 0;
+		}
+		WRITE_ONCE(q->tail, q->tail + n);
+		if (n)
+			scull_p_dequeued(dev, n, 0, q->head - q->tail);
+		up(&q->sem);
+
+		smp_mb();
+		if (n && waitqueue_active(&q->outq))
+			wake_up_interruptible_poll(&q->outq,
+						   EPOLLOUT | EPOLLWRNORM);
+		done += n;
+		dev->rr = cpu + 1;
+	}
+	up(&dev->sem);
+
+	if (!done)
+		return faulted ? -EFAULT : -ERESTARTSYS;
+	PDEBUG("\"%s\" did read %li bytes\n", current->comm, (long)done);
+	return done;
+}
+
+static ssize_t scull_p_mq_write(struct scull_pipe *dev, struct file *filp,
+				const char __user *buf, size_t count)
+{
+	/* if we migrate after this, we just use the queue of another cpu */
+	struct scull_p_queue *q =
+		per_cpu_ptr(dev->queues, raw_smp_processor_id());
+	unsigned int head;
+	size_t n;
+
+	if (down_interruptible(&q->sem))
+		return -ERESTARTSYS;
+	while (q->head - READ_ONCE(q->tail) == dev->buffersize) { /* full */
+		up(&q->sem);
+		if (filp->f_flags & O_NONBLOCK)
+			return scull_p_eagain(dev, SCULL_P_WR);
+		PDEBUG("\"%s\" writing: going to sleep\n", current->comm);
+		if (scull_p_wait(dev, SCULL_P_WR, q->outq,
+				 READ_ONCE(q->head) - READ_ONCE(q->tail) !=
+					 dev->buffersize))
+			return -ERESTARTSYS; /* signal: tell the fs layer to handle it */
+		if (down_interruptible(&q->sem))
+			return -ERESTARTSYS;
+	}
+
+	head = q->head;
+	n = min(count, (size_t)(dev->buffersize - (head - q->tail)));
+	if (scull_p_copy_in(q->buffer, dev->buffersize, buf, head, n)) {
+		up(&q->sem);
+		return -EFAULT;
+	}
+	WRITE_ONCE(q->head, head + n);
+	scull_p_enqueued(dev, n, 0, head + n - q->tail);
+	up(&q->sem);
+
+	smp_mb();
+	if (waitqueue_active(&dev->inq))
+		wake_up_interruptible_poll(&dev->inq, EPOLLIN | EPOLLRDNORM);
+	if (head == READ_ONCE(q->tail)) /* was empty */
+		scull_p_kill_fasync(dev);
+	PDEBUG("\"%s\" did write %li bytes\n", current->comm, (long)n);
+	return n;
+}
+
+/*
+ * Page mode copies. A slot is released as soon as it is drained; write()
+ * appends to the last slot while it is one of our own pages with room
+ * left, and starts a new page otherwise.
+ */
+static ssize_t scull_p_pages_take(struct scull_pipe *dev, char __user *buf,
+				  size_t count)
+{
+	struct scull_p_slot *slot;
+	size_t done = 0, n, left = 0;
+	void *vaddr;
+
+	while (done < count && dev->stail != dev->shead) {
+		slot = &dev->slots[dev->stail & (dev->nslots - 1)];
+		n = min_t(size_t, count - done, slot->len);
+		vaddr = kmap_local_page(slot->page);
+		left = copy_to_user(buf + done, vaddr + slot->offset, n);
+		kunmap_local(vaddr);
+		slot->offset += n - left;
+		slot->len -= n - left;
+		done += n - left;
+		if (left)
+			break;
+		if (!slot->len) {
+			put_page(slot->page);
+			dev->stail++;
+		}
+	}
+	return done ? done : (left ? -EFAULT : 0);
+}
+
+static ssize_t scull_p_pages_put(struct scull_pipe *dev,
+				 const char __user *buf, size_t count)
+{
+	struct scull_p_slot *slot = NULL;
+	size_t done = 0, n, left = 0;
+	struct page *page;
+	void *vaddr;
+
+	if (dev->shead != dev->stail)
+		slot = &dev->slots[(dev->shead - 1) & (dev->nslots - 1)];
+	while (done < count) {
+		if (!slot || !(slot->flags & SCULL_P_SLOT_OWNED) ||
+		    slot->offset + slot->len == PAGE_SIZE) {
+			if (dev->shead - dev->stail == dev->nslots)
+				break; /* full */
+			page = alloc_page(GFP_HIGHUSER);
+			if (!page)
+				return done ? done : -ENOMEM;
+			slot = &dev->slots[dev->shead++ & (dev->nslots - 1)];
+			slot->page = page;
+			slot->offset = slot->len = 0;
+			slot->flags = SCULL_P_SLOT_OWNED;
+		}
+		n = min_t(size_t, count - done,
+			  PAGE_SIZE - slot->offset - slot->len);
+		vaddr = kmap_local_page(slot->page);
+		left = copy_from_user(vaddr + slot->offset + slot->len,
+				      buf + done, n);
+		kunmap_local(vaddr);
+		slot->len += n - left;
+		done += n - left;
+		if (left)
+			break;
+	}
+	return done ? done : (left ? -EFAULT : 0);
+}
+
+/*
+ * The locked modes move data with these two, called with the device
+ * semaphore held. They return how many bytes were moved, or an error if
+ * nothing could be.
+ */
+static ssize_t scull_p_take(struct scull_pipe *dev, char __user *buf,
+			    size_t count)
+{
+	ssize_t n;
+
+	if (dev->pages) {
+		n = scull_p_pages_take(dev, buf, count);
+	} else {
+		n = min(count, (size_t)(dev->head - dev->tail));
+		if (scull_p_copy_out(dev->buffer, dev->buffersize, buf,
+				     dev->tail, n))
+			return -EFAULT;
+	}
+	if (n > 0) {
+		dev->tail += n;
+		dev->copied_out += n;
+		scull_p_dequeued(dev, n, dev->tail, dev->head - dev->tail);
+	}
+	return n;
+}
+
+static ssize_t scull_p_put(struct scull_pipe *dev, const char __user *buf,
+			   size_t count)
+{
+	ssize_t n;
+
+	if (dev->pages) {
+		n = scull_p_pages_put(dev, buf, count);
+	} else {
+		n = min(count, (size_t)spacefree(dev));
+		if (scull_p_copy_in(dev->buffer, dev->buffersize, buf,
+				    dev->head, n))
+			return -EFAULT;
+	}
+	if (n > 0) {
+		dev->head += n;
+		dev->copied_in += n;
+		scull_p_enqueued(dev, n, dev->head, dev->head - dev->tail);
+	}
+	return n;
+}
+
+/* How many bytes the pipe holds when it is full of whole pages */
+static unsigned int scull_p_size(struct scull_pipe *dev)
+{
+	return dev->pages ? dev->nslots << PAGE_SHIFT : dev->buffersize;
+}
+
+/*
+ * Wakeup watermarks, for the locked modes. Data is readable once there
+ * is enough of it for the reader ("want", capped by rcvlowat), once the
+ * flush timer went off, or when the pipe is full and no more can come.
+ * Space is writable once sndlowat bytes, or the whole pipe, are free.
+ */
+static int scull_p_readable(struct scull_pipe *dev, size_t want)
+{
+	unsigned int fill = READ_ONCE(dev->head) - READ_ONCE(dev->tail);
+
+	return fill &&
+	       (fill >= min_t(size_t, want, READ_ONCE(dev->rcvlowat)) ||
+		READ_ONCE(dev->rflush) || !spacefree(dev));
+}
+
+static int scull_p_writable(struct scull_pipe *dev)
+{
+	return spacefree(dev) >=
+	       min(READ_ONCE(dev->sndlowat), scull_p_size(dev));
+}
+
+/*
+ * Called by writers with the semaphore held, after adding data: wake the
+ * readers if the data is worth it, or make sure the timer will. Sleepers
+ * leave the smallest "want" among them in rwant, so a short read isn't
+ * kept waiting for rcvlowat; each wakeup sends them all back to say
+ * again (see scull_getreaddata()).
+ */
+static void scull_p_wake_readers(struct scull_pipe *dev)
+{
+	if (dev->head == dev->tail)
+		return;
+	if (scull_p_readable(dev, dev->rwant)) {
+		dev->rwant = UINT_MAX;
+		WRITE_ONCE(dev->rgen, dev->rgen + 1);
+		dev->rwakeups++;
+		/* blocked in read() and select() */
+		wake_up_interruptible_poll(&dev->inq, EPOLLIN | EPOLLRDNORM);
+		/* and signal asynchronous readers, explained late in chapter 5 */
+		scull_p_kill_fasync(dev);
+		return;
+	}
+	dev->rbatched++;
+	if (dev->flush_us && !hrtimer_is_queued(&dev->flush_timer))
+		hrtimer_start(&dev->flush_timer, us_to_ktime(dev->flush_us),
+			      HRTIMER_MODE_REL);
+}
+
+/* Called by readers with the semaphore held, after taking data */
+static void scull_p_wake_writers(struct scull_pipe *dev)
+{
+	if (dev->head == dev->tail) { /* drained: nothing left to flush */
+		WRITE_ONCE(dev->rflush, 0);
+		hrtimer_try_to_cancel(&dev->flush_timer);
+	}
+	if (scull_p_writable(dev)) {
+		dev->wwakeups++;
+		wake_up_interruptible_poll(&dev->outq, EPOLLOUT | EPOLLWRNORM);
+	} else {
+		dev->wbatched++;
+	}
+}
+
+static enum hrtimer_restart scull_p_flush(struct hrtimer *timer)
+{
+	struct scull_pipe *dev =
+		container_of(timer, struct scull_pipe, flush_timer);
+
+	if (READ_ONCE(dev->head) == READ_ONCE(dev->tail))
+		return HRTIMER_NORESTART; /* a reader got there first */
+	WRITE_ONCE(dev->rflush, 1);
+	dev->flushes++;
+	wake_up_interruptible_poll(&dev->inq, EPOLLIN | EPOLLRDNORM);
+	scull_p_kill_fasync(dev);
+	return HRTIMER_NORESTART;
+}
+
+/*
+ * Busy poll, for readers with a budget: rather than going to sleep right
+ * away, spin on the indices for up to spin_cur microseconds, and save the
+ * wakeup if the writer shows up in time. The spin stops early if the cpu
+ * is wanted elsewhere or a signal is pending. Called without any lock.
+ */
+static int scull_p_data_ready(struct scull_pipe *dev, size_t want)
+{
+	if (dev->mq)
+		return scull_p_mq_readable(dev);
+	if (dev->spsc)
+		return smp_load_acquire(scull_p_headp(dev)) !=
+		       READ_ONCE(*scull_p_tailp(dev));
+	return scull_p_readable(dev, want);
+}
+
+static int scull_p_busy_poll(struct file *filp, size_t want)
+{
+	struct scull_p_fd *pf = filp->private_data;
+	struct scull_pipe *dev = pf->dev;
+	u64 start, now, end;
+	int hit = 0;
+
+	if (!READ_ONCE(pf->spin_us))
+		return 0;
+	start = now = local_clock();
+	end = start + (u64)pf->spin_cur * NSEC_PER_USEC;
+	while (!need_resched() && !signal_pending(current) && now < end) {
+		if (scull_p_data_ready(dev, want)) {
+			hit = 1;
+			break;
+		}
+		cpu_relax();
+		now = local_clock();
+	}
+
+	atomic_long_inc(&dev->spins);
+	atomic_long_add(local_clock() - start, &dev->spin_ns);
+	if (hit) {
+		atomic_long_inc(&dev->spin_hits);
+		pf->spin_cur = min(pf->spin_cur * 2, pf->spin_us);
+	} else {
+		pf->spin_cur = max(pf->spin_cur / 2, 1U);
+	}
+	return hit;
+}
+
+/*
+ * Record mode. Each write() is one message, stored in the byte ring as a
+ * native __u32 length followed by the data, padded to a multiple of the
+ * header size. Every record then starts aligned, and as the buffer size
+ * is a power of two a header never straddles the wrap: it is read and
+ * written in place. Messages longer than the reader's buffer are
+ * truncated, the rest is dropped, like SOCK_SEQPACKET does.
+ */
+static inline unsigned int scull_p_reclen(u32 len)
+{
+	return SCULL_P_RECHDR + ALIGN(len, SCULL_P_RECHDR);
+}
+
+static inline u32 *scull_p_rechdr(struct scull_pipe *dev, unsigned int idx)
+{
+	return (u32 *)(dev->buffer + (idx & (dev->buffersize - 1)));
+}
+
+static ssize_t scull_p_take_record(struct scull_pipe *dev, char __user *buf,
+				   size_t count)
+{
+	u32 len = *scull_p_rechdr(dev, dev->tail);
+	size_t n = min_t(size_t, count, len);
+
+	if (scull_p_copy_out(dev->buffer, dev->buffersize, buf,
+			     dev->tail + SCULL_P_RECHDR, n))
+		return -EFAULT; /* the message stays there */
+	if (n < len)
+		dev->truncated++;
+	dev->tail += scull_p_reclen(len);
+	dev->copied_out += n;
+	dev->msgs_out++;
+	scull_p_dequeued(dev, n, dev->tail, dev->head - dev->tail);
+	return n;
+}
+
+/* Called with the semaphore held, which is released before returning */
+static ssize_t scull_p_put_record(struct scull_pipe *dev, struct file *filp,
+				  const char __user *buf, size_t count)
+{
+	unsigned int need;
+	int result;
+
+	if (count > dev->buffersize - SCULL_P_RECHDR) {
+		up(&dev->sem);
+		return -EMSGSIZE; /* would never fit */
+	}
+	need = scull_p_reclen(count);
+	result = scull_getwritespace(dev, filp, need);
+	if (result)
+		return result; /* scull_getwritespace called up(&dev->sem) */
+
+	*scull_p_rechdr(dev, dev->head + need - SCULL_P_RECHDR) = 0; /* pad */
+	if (scull_p_copy_in(dev->buffer, dev->buffersize, buf,
+			    dev->head + SCULL_P_RECHDR, count)) {
+		up(&dev->sem);
+		return -EFAULT;
+	}
+	*scull_p_rechdr(dev, dev->head) = count;
+	dev->head += need;
+	dev->copied_in += count;
+	dev->msgs_in++;
+	scull_p_enqueued(dev, count, dev->head, dev->head - dev->tail);
+	scull_p_wake_readers(dev);
+	up(&dev->sem);
+	return count;
+}
+
+/*
+ * Broadcast mode. Writers use the locked byte ring as usual, with "tail"
+ * standing for the slowest reader; each reader copies from its own
+ * cursor, and when the slowest one moves the room it leaves is given
+ * to the writers. All of it under the semaphore.
+ */
+static int scull_p_bcast_advance(struct scull_pipe *dev)
+{
+	struct scull_p_fd *pf;
+	unsigned int min = UINT_MAX;
+
+	if (list_empty(&dev->readers))
+		return 0; /* keep the data for the next reader */
+	list_for_each_entry(pf, &dev->readers, list)
+		min = min(min, pf->tail - dev->tail);
+	dev->tail += min;
+	return min != 0;
+}
+
+static ssize_t scull_p_bcast_read(struct scull_pipe *dev, struct file *filp,
+				  char __user *buf, size_t count)
+{
+	struct scull_p_fd *pf = filp->private_data;
+	size_t n;
+
+	if (down_interruptible(&dev->sem))
+		return -ERESTARTSYS;
+	while (pf->tail == dev->head) { /* we have read it all */
+		up(&dev->sem);
+		if (filp->f_flags & O_NONBLOCK)
+			return scull_p_eagain(dev, SCULL_P_RD);
+		PDEBUG("\"%s\" reading: going to sleep\n", current->comm);
+		if (scull_p_wait(dev, SCULL_P_RD, dev->inq,
+				 READ_ONCE(dev->head) != pf->tail))
+			return -ERESTARTSYS; /* signal: tell the fs layer to handle it */
+		if (down_interruptible(&dev->sem))
+			return -ERESTARTSYS;
+	}
+
+	n = min(count, (size_t)(dev->head - pf->tail));
+	if (scull_p_copy_out(dev->buffer, dev->buffersize, buf, pf->tail, n)) {
+		up(&dev->sem);
+		return -EFAULT;
+	}
+	WRITE_ONCE(pf->tail, pf->tail + n);
+	dev->copied_out += n;
+	if (scull_p_bcast_advance(dev))
+		scull_p_wake_writers(dev);
+	scull_p_dequeued(dev, n, dev->tail, dev->head - dev->tail);
+	up(&dev->sem);
+	PDEBUG("\"%s\" did read %li bytes\n", current->comm, (long)n);
+	return n;
+}
 
-MODULE_AUTHOR("Alessandro Rubini, Jonathan Corbet");
-MODULE_LICENSE("Dual BSD/GPL");
+/*
+ * Lane mode. Everything is under the semaphore; head and tail of the
+ * pipe are kept as the sums of those of the lanes, so that the fill level
+ * and the readers' wakeups work as in the other locked modes.
+ */
 
-static struct scull_pipe *scull_p_devices;
+/* The first lane with data and credit left, starting a new round if none */
+static struct scull_p_lane *scull_p_lane_pick(struct scull_pipe *dev)
+{
+	struct scull_p_lane *l;
+	int i;
 
-static int spacefree(struct scull_pipe *dev);
-static int scull_p_fasync(int fd, struct file *filp, int mode);
+	for (;;) {
+		for (i = 0; i < dev->nlanes; i++) {
+			l = &dev->lanes[i];
+			if (l->head != l->tail && l->credit > 0)
+				return l;
+		}
+		/* not cumulative: a lane can't save up credit while idle */
+		for (i = 0; i < dev->nlanes; i++)
+			dev->lanes[i].credit = dev->lanes[i].weight;
+	}
+}
 
-static int scull_p_open(struct inode *inode, struct file *filp)
+static ssize_t scull_p_lane_read(struct scull_pipe *dev, struct file *filp,
+				 char __user *buf, size_t count)
 {
-	struct scull_pipe *dev;
-
-	dev = container_of(inode->i_cdev, struct scull_pipe, cdev);
-	filp->private_data = dev;
+	struct scull_p_lane *l;
+	size_t n;
 
 	if (down_interruptible(&dev->sem))
 		return -ERESTARTSYS;
-	if (!dev->buffer) {
-		/* allocate the buffer */
-		dev->buffer = kmalloc(scull_p_buffer, GFP_KERNEL);
-		if (!dev->buffer) {
-			up(&dev->sem);
-			return -ENOMEM;
+	while (dev->head == dev->tail) { /* all the lanes are empty */
+		up(&dev->sem);
+		if (filp->f_flags & O_NONBLOCK)
+			return scull_p_eagain(dev, SCULL_P_RD);
+		if (!scull_p_busy_poll(filp, 1)) {
+			PDEBUG("\"%s\" reading: going to sleep\n", current->comm);
+			if (scull_p_wait(dev, SCULL_P_RD, dev->inq,
+					 READ_ONCE(dev->head) !=
+						 READ_ONCE(dev->tail)))
+				return -ERESTARTSYS; /* signal: tell the fs layer to handle it */
 		}
+		if (down_interruptible(&dev->sem))
+			return -ERESTARTSYS;
 	}
-	dev->buffersize = scull_p_buffer;
-	dev->end = dev->buffer + dev->buffersize;
-	dev->rp = dev->wp = dev->buffer; /* rd and wr from the beginning */
 
-	/* use f_mode,not  f_flags: it's cleaner (fs/open.c tells why) */
-	if (filp->f_mode & FMODE_READ)
-		dev->nreaders++;
-	if (filp->f_mode & FMODE_WRITE)
-		dev->nwriters++;
+	/* one lane per read, and no more than its credit */
+	l = scull_p_lane_pick(dev);
+	n = min3(count, (size_t)(l->head - l->tail), (size_t)l->credit);
+	if (scull_p_copy_out(l->buffer, dev->buffersize, buf, l->tail, n)) {
+		up(&dev->sem);
+		return -EFAULT;
+	}
+	l->credit -= n;
+	WRITE_ONCE(l->tail, l->tail + n);
+	WRITE_ONCE(dev->tail, dev->tail + n);
+	dev->copied_out += n;
+	scull_p_unmark(&l->lat, l->tail);
+	scull_p_dequeued(dev, n, dev->tail, dev->head - dev->tail);
+	smp_mb(); /* pairs with prepare_to_wait() */
+	if (waitqueue_active(&l->outq))
+		wake_up_interruptible_poll(&l->outq, EPOLLOUT | EPOLLWRNORM);
 	up(&dev->sem);
-
-	return nonseekable_open(inode, filp);
+	PDEBUG("\"%s\" did read %li bytes from lane %li\n", current->comm,
+	       (long)n, (long)(l - dev->lanes));
+	return n;
 }
 
-static int scull_p_release(struct inode *inode, struct file *filp)
+static ssize_t scull_p_lane_write(struct scull_pipe *dev, struct file *filp,
+				  const char __user *buf, size_t count)
 {
-	struct scull_pipe *dev = filp->private_data;
+	struct scull_p_fd *pf = filp->private_data;
+	struct scull_p_lane *l = &dev->lanes[READ_ONCE(pf->lane)];
+	size_t n;
 
-	/* remove this filp from the asynchronously notified filp's */
-	scull_p_fasync(-1, filp, 0);
-	down(&dev->sem);
-	if (filp->f_mode & FMODE_READ)
-		dev->nreaders--;
-	if (filp->f_mode & FMODE_WRITE)
-		dev->nwriters--;
-	if (dev->nreaders + dev->nwriters == 0) {
-		kfree(dev->buffer);
-		dev->buffer =
-			NULL; /* the other fields are not checked on open */
+	if (down_interruptible(&dev->sem))
+		return -ERESTARTSYS;
+	while (l->head - l->tail == dev->buffersize) { /* our lane is full */
+		up(&dev->sem);
+		if (filp->f_flags & O_NONBLOCK)
+			return scull_p_eagain(dev, SCULL_P_WR);
+		PDEBUG("\"%s\" writing: going to sleep\n", current->comm);
+		if (scull_p_wait(dev, SCULL_P_WR, l->outq,
+				 READ_ONCE(l->head) - READ_ONCE(l->tail) !=
+					 dev->buffersize))
+			return -ERESTARTSYS; /* signal: tell the fs layer to handle it */
+		if (down_interruptible(&dev->sem))
+			return -ERESTARTSYS;
+	}
+
+	n = min(count, (size_t)(dev->buffersize - (l->head - l->tail)));
+	if (scull_p_copy_in(l->buffer, dev->buffersize, buf, l->head, n)) {
+		up(&dev->sem);
+		return -EFAULT;
 	}
+	scull_p_mark(&l->lat, l->head + n);
+	WRITE_ONCE(l->head, l->head + n);
+	WRITE_ONCE(dev->head, dev->head + n);
+	dev->copied_in += n;
+	scull_p_enqueued(dev, n, dev->head, dev->head - dev->tail);
+	scull_p_wake_readers(dev);
+	up(&dev->sem);
+	PDEBUG("\"%s\" did write %li bytes to lane %li\n", current->comm,
+	       (long)n, (long)(l - dev->lanes));
+	return n;
+}
+
+/* Set the weight of the lane a file writes to, returning the old one */
+static long scull_p_set_weight(struct scull_pipe *dev, struct scull_p_fd *pf,
+			       unsigned long arg)
+{
+	struct scull_p_lane *l;
+	long old;
+
+	if (!dev->nlanes)
+		return -EINVAL;
+	if (down_interruptible(&dev->sem))
+		return -ERESTARTSYS;
+	l = &dev->lanes[pf->lane];
+	old = l->weight;
+	l->weight = clamp_t(unsigned long, arg, 1, INT_MAX);
+	l->credit = min_t(int, l->credit, l->weight);
 	up(&dev->sem);
+	return old;
+}
+
+/* Wait for data to read; caller must hold device semaphore.  On error
+ * the semaphore will be released before returning. */
+static int scull_getreaddata(struct scull_pipe *dev, struct file *filp,
+			     size_t want)
+{
+	unsigned int gen;
+
+	while (!scull_p_readable(dev, want)) { /* not enough to read */
+		if (filp->f_flags & O_NONBLOCK) {
+			if (dev->head != dev->tail)
+				break; /* take what is there, like sockets do */
+			up(&dev->sem);
+			return scull_p_eagain(dev, SCULL_P_RD);
+		}
+		/* until the next wakeup: then check in again */
+		dev->rwant = min_t(size_t, dev->rwant, want);
+		gen = dev->rgen;
+		up(&dev->sem); /* release the lock */
+		if (!scull_p_busy_poll(filp, want)) {
+			PDEBUG("\"%s\" reading: going to sleep\n", current->comm);
+			if (scull_p_wait(dev, SCULL_P_RD, dev->inq,
+					 scull_p_readable(dev, want) ||
+					 READ_ONCE(dev->rgen) != gen))
+				return -ERESTARTSYS; /* signal: tell the fs layer to handle it */
+		}
+		/* otherwise loop, but first reacquire the lock */
+		if (down_interruptible(&dev->sem))
+			return -ERESTARTSYS;
+	}
 	return 0;
 }
 
@@ -100,140 +1272,388 @@ static int scull_p_release(struct inode *inode, struct file *filp)
 static ssize_t scull_p_read(struct file *filp, char __user *buf, size_t count,
 			    loff_t *f_pos)
 {
-	struct scull_pipe *dev = filp->private_data;
+	struct scull_pipe *dev = scull_p_dev(filp);
+	size_t done = 0;
+	ssize_t n;
+	int result;
+
+	if (dev->spsc)
+		return scull_p_spsc_read(dev, filp, buf, count);
+	if (dev->mq)
+		return scull_p_mq_read(dev, filp, buf, count);
+	if (dev->nlanes)
+		return scull_p_lane_read(dev, filp, buf, count);
+	if (dev->bcast)
+		return scull_p_bcast_read(dev, filp, buf, count);
 
 	if (down_interruptible(&dev->sem))
 		return -ERESTARTSYS;
 
-	while (dev->rp == dev->wp) { /* nothing to read */
-		up(&dev->sem); /* release the lock */
-		if (filp->f_flags & O_NONBLOCK)
-			return -EAGAIN;
-		PDEBUG("\"%s\" reading: going to sleep\n", current->comm);
-		if (wait_event_interruptible(dev->inq, (dev->rp != dev->wp)))
-			return -ERESTARTSYS; /* signal: tell the fs layer to handle it */
-		/* otherwise loop, but first reacquire the lock */
-		if (down_interruptible(&dev->sem))
-			return -ERESTARTSYS;
-	}
-	/* ok, data is there, return something */
-	if (dev->wp > dev->rp)
-		count = min(count, (size_t)(dev->wp - dev->rp));
-	else /* the write pointer has wrapped, return data up to dev->end */
-		count = min(count, (size_t)(dev->end - dev->rp));
-	if (copy_to_user(buf, dev->rp, count)) {
+	/* Make sure there's something to read */
+	result = scull_getreaddata(dev, filp, count);
+	if (result)
+		return result; /* scull_getreaddata called up(&dev->sem) */
+
+	if (dev->records) { /* one message per read */
+		n = scull_p_take_record(dev, buf, count);
+		scull_p_wake_writers(dev);
 		up(&dev->sem);
-		return -EFAULT;
+		return n;
 	}
-	dev->rp += count;
-	if (dev->rp == dev->end)
-		dev->rp = dev->buffer; /* wrapped */
-	up(&dev->sem);
 
-	/* finally, awake any writers and return */
-	wake_up_interruptible(&dev->outq);
-	PDEBUG("\"%s\" did read %li bytes\n", current->comm, (long)count);
-	return count;
+	/*
+	 * ok, data is there: return all of it, both sides of the wrap, then
+	 * keep going while writers add more, without sleeping again
+	 */
+	for (;;) {
+		n = scull_p_take(dev, buf + done, count - done);
+		if (n < 0) {
+			up(&dev->sem);
+			return done ? done : n;
+		}
+		done += n;
+		scull_p_wake_writers(dev);
+		up(&dev->sem);
+
+		if (done == count || down_interruptible(&dev->sem))
+			break;
+		if (dev->head == dev->tail) {
+			up(&dev->sem);
+			break;
+		}
+	}
+	PDEBUG("\"%s\" did read %li bytes\n", current->comm, (long)done);
+	return done;
 }
 
-/* Wait for space for writing; caller must hold device semaphore.  On
- * error the semaphore will be released before returning. */
-static int scull_getwritespace(struct scull_pipe *dev, struct file *filp)
+/* Wait for "need" bytes of space for writing; caller must hold device
+ * semaphore.  On error the semaphore will be released before returning. */
+static int scull_getwritespace(struct scull_pipe *dev, struct file *filp,
+			       unsigned int need)
 {
-	while (spacefree(dev) == 0) { /* full */
+	while (spacefree(dev) < need) { /* full */
 		DEFINE_WAIT(wait);
+		u64 t0;
 
 		up(&dev->sem);
 		if (filp->f_flags & O_NONBLOCK)
-			return -EAGAIN;
+			return scull_p_eagain(dev, SCULL_P_WR);
 		PDEBUG("\"%s\" writing: going to sleep\n", current->comm);
+		t0 = ktime_get_ns();
 		prepare_to_wait(&dev->outq, &wait, TASK_INTERRUPTIBLE);
-		if (spacefree(dev) == 0)
+		if (spacefree(dev) < need)
 			schedule();
 		finish_wait(&dev->outq, &wait);
+		scull_p_blocked(dev, SCULL_P_WR, t0);
 		if (signal_pending(current))
 			return -ERESTARTSYS; /* signal: tell the fs layer to handle it */
 		if (down_interruptible(&dev->sem))
 			return -ERESTARTSYS;
+		if (need > dev->buffersize) { /* shrunk while we slept */
+			up(&dev->sem);
+			return -EMSGSIZE;
+		}
 	}
 	return 0;
 }
 
-/* How much space is free? */
+/*
+ * How much space is free? Poll calls this without the semaphore, which
+ * only makes the answer a snapshot.
+ */
 static int spacefree(struct scull_pipe *dev)
 {
-	if (dev->rp == dev->wp)
-		return dev->buffersize - 1;
-	return ((dev->rp + dev->buffersize - dev->wp) % dev->buffersize) - 1;
+	unsigned int shead, stail;
+	struct scull_p_slot *last;
+	int room;
+
+	if (!dev->pages)
+		return READ_ONCE(dev->buffersize) -
+		       (READ_ONCE(dev->head) - READ_ONCE(dev->tail));
+
+	/* free slots, plus what is left in the page write() appends to */
+	shead = READ_ONCE(dev->shead);
+	stail = READ_ONCE(dev->stail);
+	room = (dev->nslots - (shead - stail)) * PAGE_SIZE;
+	if (shead != stail) {
+		last = &dev->slots[(shead - 1) & (dev->nslots - 1)];
+		if (READ_ONCE(last->flags) & SCULL_P_SLOT_OWNED)
+			room += PAGE_SIZE - READ_ONCE(last->offset) -
+				READ_ONCE(last->len);
+	}
+	return room;
 }
 
 static ssize_t scull_p_write(struct file *filp, const char __user *buf,
 			     size_t count, loff_t *f_pos)
 {
-	struct scull_pipe *dev = filp->private_data;
+	struct scull_pipe *dev = scull_p_dev(filp);
+	size_t done = 0;
+	ssize_t n;
 	int result;
 
+	if (dev->spsc)
+		return scull_p_spsc_write(dev, filp, buf, count);
+	if (dev->mq)
+		return scull_p_mq_write(dev, filp, buf, count);
+	if (dev->nlanes)
+		return scull_p_lane_write(dev, filp, buf, count);
+
 	if (down_interruptible(&dev->sem))
 		return -ERESTARTSYS;
 
+	if (dev->records)
+		return scull_p_put_record(dev, filp, buf, count);
+
 	/* Make sure there's space to write */
-	result = scull_getwritespace(dev, filp);
+	result = scull_getwritespace(dev, filp, 1);
 	if (result)
 		return result; /* scull_getwritespace called up(&dev->sem) */
 
-	/* ok, space is there, accept something */
-	count = min(count, (size_t)spacefree(dev));
-	if (dev->wp >= dev->rp)
-		count = min(count,
-			    (size_t)(dev->end - dev->wp)); /* to end-of-buf */
-	else /* the write pointer has wrapped, fill up to rp-1 */
-		count = min(count, (size_t)(dev->rp - dev->wp - 1));
-	PDEBUG("Going to accept %li bytes to %p from %p\n", (long)count,
-	       dev->wp, buf);
-	if (copy_from_user(dev->wp, buf, count)) {
+	/*
+	 * ok, space is there: fill all of it, both sides of the wrap, then
+	 * keep going while readers free more, without sleeping again
+	 */
+	for (;;) {
+		PDEBUG("Going to accept %li bytes at %u from %p\n",
+		       (long)(count - done), dev->head, buf + done);
+		n = scull_p_put(dev, buf + done, count - done);
+		if (n < 0) {
+			up(&dev->sem);
+			return done ? done : n;
+		}
+		done += n;
+		scull_p_wake_readers(dev);
+		up(&dev->sem);
+
+		if (done == count || down_interruptible(&dev->sem))
+			break;
+		if (spacefree(dev) == 0) {
+			up(&dev->sem);
+			break;
+		}
+	}
+	PDEBUG("\"%s\" did write %li bytes\n", current->comm, (long)done);
+	return done;
+}
+
+/*
+ * Splice, page mode only. Nothing is copied: pages spliced in are kept
+ * in our slots with a reference taken from the pipe_buffer, and pages
+ * spliced out are handed to the other pipe with a reference of its own.
+ * Both run with the other pipe locked, so the pipe lock always nests
+ * outside our semaphore.
+ */
+static void scull_p_buf_release(struct pipe_inode_info *pipe,
+				struct pipe_buffer *buf)
+{
+	put_page(buf->page);
+}
+
+/* no .try_steal: the page may be shared with our ring or its owner */
+static const struct pipe_buf_operations scull_p_buf_ops = {
+	.release = scull_p_buf_release,
+	.get = generic_pipe_buf_get,
+};
+
+static ssize_t scull_p_splice_read(struct file *filp, loff_t *ppos,
+				   struct pipe_inode_info *pipe, size_t len,
+				   unsigned int flags)
+{
+	struct scull_pipe *dev = scull_p_dev(filp);
+	struct scull_p_slot *slot;
+	struct pipe_buffer pbuf;
+	size_t done = 0;
+	ssize_t ret = 0;
+	unsigned int gen;
+
+	if (!dev->pages)
+		return -EINVAL;
+	if (down_interruptible(&dev->sem))
+		return -ERESTARTSYS;
+	while (!scull_p_readable(dev, len)) { /* not enough to splice */
+		if ((filp->f_flags & O_NONBLOCK) || (flags & SPLICE_F_NONBLOCK)) {
+			if (dev->head != dev->tail)
+				break;
+			up(&dev->sem);
+			return scull_p_eagain(dev, SCULL_P_RD);
+		}
+		dev->rwant = min_t(size_t, dev->rwant, len); /* as in read() */
+		gen = dev->rgen;
+		up(&dev->sem);
+		if (scull_p_wait(dev, SCULL_P_RD, dev->inq,
+				 scull_p_readable(dev, len) ||
+				 READ_ONCE(dev->rgen) != gen))
+			return -ERESTARTSYS;
+		if (down_interruptible(&dev->sem))
+			return -ERESTARTSYS;
+	}
+
+	while (done < len && dev->stail != dev->shead) {
+		slot = &dev->slots[dev->stail & (dev->nslots - 1)];
+		pbuf = (struct pipe_buffer){
+			.page = slot->page,
+			.offset = slot->offset,
+			.len = min_t(size_t, len - done, slot->len),
+			.ops = &scull_p_buf_ops,
+		};
+		if (pbuf.len) {
+			get_page(pbuf.page); /* the pipe's own reference */
+			ret = add_to_pipe(pipe, &pbuf);
+			if (ret < 0)
+				break; /* full or no readers: it dropped the page */
+		}
+		slot->offset += pbuf.len;
+		slot->len -= pbuf.len;
+		done += pbuf.len;
+		if (!slot->len) {
+			put_page(slot->page);
+			dev->stail++;
+		}
+	}
+	dev->tail += done;
+	dev->spliced_out += done;
+	if (done) {
+		scull_p_dequeued(dev, done, dev->tail, dev->head - dev->tail);
+		scull_p_wake_writers(dev);
+	}
+	up(&dev->sem);
+
+	return done ? done : ret;
+}
+
+static int scull_p_splice_actor(struct pipe_inode_info *pipe,
+				struct pipe_buffer *buf, struct splice_desc *sd)
+{
+	struct scull_pipe *dev = scull_p_dev(sd->u.file);
+	struct scull_p_slot *slot;
+
+	if (down_interruptible(&dev->sem))
+		return -ERESTARTSYS;
+	if (dev->shead - dev->stail == dev->nslots) {
+		up(&dev->sem);
+		return -EAGAIN; /* no free slot: scull_p_splice_write waits */
+	}
+	if (!pipe_buf_get(pipe, buf)) {
 		up(&dev->sem);
 		return -EFAULT;
 	}
-	dev->wp += count;
-	if (dev->wp == dev->end)
-		dev->wp = dev->buffer; /* wrapped */
+	slot = &dev->slots[dev->shead++ & (dev->nslots - 1)];
+	slot->page = buf->page;
+	slot->offset = buf->offset;
+	slot->len = sd->len;
+	slot->flags = 0; /* not ours: never written to */
+	dev->head += sd->len;
+	dev->spliced_in += sd->len;
+	scull_p_enqueued(dev, sd->len, dev->head, dev->head - dev->tail);
+	scull_p_wake_readers(dev);
 	up(&dev->sem);
 
-	/* finally, awake any reader */
-	wake_up_interruptible(&dev->inq); /* blocked in read() and select() */
+	return sd->len;
+}
 
-	/* and signal asynchronous readers, explained late in chapter 5 */
-	if (dev->async_queue)
-		kill_fasync(&dev->async_queue, SIGIO, POLL_IN);
-	PDEBUG("\"%s\" did write %li bytes\n", current->comm, (long)count);
-	return count;
+static ssize_t scull_p_splice_write(struct pipe_inode_info *pipe,
+				    struct file *filp, loff_t *ppos,
+				    size_t len, unsigned int flags)
+{
+	struct scull_pipe *dev = scull_p_dev(filp);
+	ssize_t ret;
+
+	if (!dev->pages)
+		return -EINVAL;
+	for (;;) {
+		ret = splice_from_pipe(pipe, filp, ppos, len, flags,
+				       scull_p_splice_actor);
+		if (ret != -EAGAIN)
+			return ret;
+		if ((filp->f_flags & O_NONBLOCK) || (flags & SPLICE_F_NONBLOCK))
+			return scull_p_eagain(dev, SCULL_P_WR);
+		/* our slots are full: wait for a reader, the pipe unlocked */
+		PDEBUG("\"%s\" splicing: going to sleep\n", current->comm);
+		if (scull_p_wait(dev, SCULL_P_WR, dev->outq,
+				 READ_ONCE(dev->shead) -
+					 READ_ONCE(dev->stail) != dev->nslots))
+			return -ERESTARTSYS;
+	}
 }
 
 static __poll_t scull_p_poll(struct file *filp, struct poll_table_struct *wait)
 {
-	struct scull_pipe *dev = filp->private_data;
+	struct scull_p_fd *pf = filp->private_data;
+	struct scull_pipe *dev = pf->dev;
+	struct scull_p_queue *q = NULL;
+	struct scull_p_lane *l = NULL;
+	unsigned int head, tail;
 	__poll_t mask = 0;
 
 	/*
-	 * The buffer is circular; it is considered full
-	 * if "wp" is right behind "rp" and empty if the
-	 * two are equal.
+	 * No lock in any mode: readiness comes from a snapshot of the
+	 * indices, taken once we are on the wait queues, so a writer can't
+	 * hold up an event loop and epoll callbacks don't pile up on the
+	 * semaphore. The barrier pairs with the one the lockless modes issue
+	 * before waitqueue_active(). Wakeups are keyed with EPOLLIN or
+	 * EPOLLOUT, and wake one exclusive (EPOLLEXCLUSIVE) waiter at most.
 	 */
-	down(&dev->sem);
+	if (dev->mq)
+		q = per_cpu_ptr(dev->queues, raw_smp_processor_id());
+	if (dev->nlanes)
+		l = &dev->lanes[READ_ONCE(pf->lane)];
 	poll_wait(filp, &dev->inq, wait);
-	poll_wait(filp, &dev->outq, wait);
-	if (dev->rp != dev->wp)
-		mask |= POLLIN | POLLRDNORM; /* readable */
-	if (spacefree(dev))
-		mask |= POLLOUT | POLLWRNORM; /* writable */
-	up(&dev->sem);
+	poll_wait(filp, q ? &q->outq : l ? &l->outq : &dev->outq, wait);
+	smp_mb();
+
+	if (l) {
+		if (READ_ONCE(dev->head) != READ_ONCE(dev->tail))
+			mask |= EPOLLIN | EPOLLRDNORM; /* some lane has data */
+		if (READ_ONCE(l->head) - READ_ONCE(l->tail) != dev->buffersize)
+			mask |= EPOLLOUT | EPOLLWRNORM; /* room in ours */
+		return mask;
+	}
+
+	if (dev->mq) {
+		if (scull_p_mq_readable(dev))
+			mask |= EPOLLIN | EPOLLRDNORM; /* some queue has data */
+		if (READ_ONCE(q->head) - READ_ONCE(q->tail) != dev->buffersize)
+			mask |= EPOLLOUT | EPOLLWRNORM; /* room in ours */
+		return mask;
+	}
+
+	if (dev->spsc) {
+		/*
+		 * The buffer is circular; it is considered full
+		 * if "head" is a whole buffer ahead of "tail" and
+		 * empty if the two are equal.
+		 */
+		if (dev->hdr) { /* ask user space peers to wake us */
+			if (poll_requested_events(wait) & EPOLLIN)
+				WRITE_ONCE(dev->hdr->rwait, 1);
+			if (poll_requested_events(wait) & EPOLLOUT)
+				WRITE_ONCE(dev->hdr->wwait, 1);
+			smp_mb();
+		}
+		head = smp_load_acquire(scull_p_headp(dev));
+		tail = smp_load_acquire(scull_p_tailp(dev));
+		if (head != tail)
+			mask |= EPOLLIN | EPOLLRDNORM; /* readable */
+		if (head - tail < dev->buffersize)
+			mask |= EPOLLOUT | EPOLLWRNORM; /* writable */
+		return mask;
+	}
 
+	/* the locked modes, which also look at the watermarks */
+	if (dev->bcast) {
+		if (READ_ONCE(dev->head) != READ_ONCE(pf->tail))
+			mask |= EPOLLIN | EPOLLRDNORM; /* new data for us */
+	} else if (scull_p_readable(dev, READ_ONCE(dev->rcvlowat)))
+		mask |= EPOLLIN | EPOLLRDNORM; /* readable */
+	if (scull_p_writable(dev))
+		mask |= EPOLLOUT | EPOLLWRNORM; /* writable */
 	return mask;
 }
 
 static int scull_p_fasync(int fd, struct file *filp, int mode)
 {
-	struct scull_pipe *dev = filp->private_data;
+	struct scull_pipe *dev = scull_p_dev(filp);
 
 	return fasync_helper(fd, filp, mode, &dev->async_queue);
 }
@@ -262,19 +1682,77 @@ static void scull_p_seq_stop(struct seq_file *s, void *v)
 
 static int scull_p_seq_show(struct seq_file *s, void *v)
 {
-	int i;
+	int i, j, cpu;
 	struct scull_pipe *p = (struct scull_pipe *)v;
+	struct scull_p_queue *q;
+	struct scull_p_lane *l;
+	struct scull_p_fd *pf;
 
+	i = p - scull_p_devices;
 	seq_printf(s, "Default buffersize is %i\n", scull_p_buffer);
 	if (down_interruptible(&p->sem))
 		return -ERESTARTSYS;
 
-	seq_printf(s, "\nDevice %i: %p\n", i, p);
-	seq_printf(s, "   Buffer: %p to %p (%i bytes)\n", p->buffer, p->end,
-		   p->buffersize);
+	seq_printf(s, "\nDevice %i: %p%s\n", i, p,
+		   p->spsc ? " (spsc)" : p->pages ? " (pages)" :
+		   p->mq ? " (mq)" : p->nlanes ? " (lanes)" :
+		   p->records ? " (records)" : p->bcast ? " (broadcast)" : "");
+	if (p->mq && p->queues) {
+		seq_printf(s, "   Queues: %u bytes per cpu, next read at %u\n",
+			   p->buffersize, p->rr % nr_cpu_ids);
+		for_each_possible_cpu(cpu) {
+			q = per_cpu_ptr(p->queues, cpu);
+			if (READ_ONCE(q->head) != READ_ONCE(q->tail))
+				seq_printf(s, "   cpu %i: head %u   tail %u\n",
+					   cpu, q->head, q->tail);
+		}
+	} else if (p->nlanes) {
+		for (j = 0; j < p->nlanes; j++) {
+			l = &p->lanes[j];
+			seq_printf(s, "   lane %i: %p (%u bytes), head %u   "
+				      "tail %u   weight %u   credit %i\n",
+				   j, l->buffer, p->buffersize, l->head,
+				   l->tail, l->weight, l->credit);
+		}
+	} else if (p->pages)
+		seq_printf(s, "   Slots: %p, %u used of %u\n", p->slots,
+			   p->shead - p->stail, p->nslots);
+	else
+		seq_printf(s, "   Buffer: %p to %p (%u bytes)\n", p->buffer,
+			   p->buffer + p->buffersize, p->buffersize);
+	if (p->hdr)
+		seq_printf(s, "   Mapped: head %u   tail %u   waiting %u/%u\n",
+			   p->hdr->head, p->hdr->tail, p->hdr->rwait,
+			   p->hdr->wwait);
 	/* seq_printf(s, "   Queues: %p %p\n", p->inq, p->outq); */
-	seq_printf(s, "   rp %p   wp %p\n", p->rp, p->wp);
+	seq_printf(s, "   head %u   tail %u   fill %u\n", p->head, p->tail,
+		   p->head - p->tail);
 	seq_printf(s, "   readers %i   writers %i\n", p->nreaders, p->nwriters);
+	seq_printf(s, "   copied in %lu out %lu   spliced in %lu out %lu\n",
+		   p->copied_in, p->copied_out, p->spliced_in, p->spliced_out);
+	if (atomic_long_read(&p->spins))
+		seq_printf(s, "   busy polls %li, %li paid off, %li us spent\n",
+			   atomic_long_read(&p->spins),
+			   atomic_long_read(&p->spin_hits),
+			   atomic_long_read(&p->spin_ns) / NSEC_PER_USEC);
+	if (p->bcast) {
+		seq_printf(s, "   broadcast to %i readers, slowest %u behind\n",
+			   p->nreaders, p->head - p->tail);
+		list_for_each_entry(pf, &p->readers, list)
+			seq_printf(s, "   reader %p: tail %u, %u behind\n", pf,
+				   pf->tail, p->head - pf->tail);
+	}
+	if (p->records)
+		seq_printf(s, "   messages in %lu out %lu   truncated %lu\n",
+			   p->msgs_in, p->msgs_out, p->truncated);
+	if (!p->spsc && !p->mq) {
+		seq_printf(s, "   rcvlowat %u   sndlowat %u   flush %u us\n",
+			   p->rcvlowat, p->sndlowat, p->flush_us);
+		seq_printf(s, "   wakeups: readers %lu (%lu saved, %lu by timer)"
+			      "   writers %lu (%lu saved)\n",
+			   p->rwakeups, p->rbatched, p->flushes, p->wwakeups,
+			   p->wbatched);
+	}
 
 	up(&p->sem);
 
@@ -319,11 +1797,293 @@ static void scull_p_remove_proc(void)
 
 #endif
 
+/*
+ * The statistics are always there, in debugfs: one file per pipe under
+ * scullp/, readable without the debugging build.
+ */
+static struct dentry *scull_p_debugfs;
+
+static void scull_p_show_delay(struct seq_file *s, struct scull_p_delay *d)
+{
+	int b, last;
+
+	for (last = SCULL_P_HIST - 1; last > 0 && !d->hist[last]; last--)
+		;
+	seq_puts(s, "queueing delay (us):\n");
+	for (b = 0; b <= last; b++)
+		seq_printf(s, "  %s %-6lu %lu\n",
+			   b < SCULL_P_HIST - 1 ? "< " : ">=",
+			   b < SCULL_P_HIST - 1 ? 1UL << b : 1UL << (b - 1),
+			   d->hist[b]);
+	seq_printf(s, "unsampled writes %lu\n", d->unmarked);
+}
+
+static int scull_p_stats_show(struct seq_file *s, void *v)
+{
+	struct scull_pipe *p = s->private;
+	struct scull_p_stats sum = {}, *st;
+	struct scull_p_lane *l;
+	int cpu, d, i;
+	unsigned int fill;
+
+	for_each_possible_cpu(cpu) {
+		st = per_cpu_ptr(p->stats, cpu);
+		for (d = SCULL_P_RD; d <= SCULL_P_WR; d++) {
+			sum.bytes[d] += st->bytes[d];
+			sum.ops[d] += st->ops[d];
+			sum.blocked[d] += st->blocked[d];
+			sum.blocked_ns[d] += st->blocked_ns[d];
+			sum.eagain[d] += st->eagain[d];
+		}
+		sum.fasync += st->fasync;
+	}
+
+	seq_printf(s, "bytes in %llu out %llu\n", sum.bytes[SCULL_P_WR],
+		   sum.bytes[SCULL_P_RD]);
+	seq_printf(s, "transfers in %llu out %llu\n", sum.ops[SCULL_P_WR],
+		   sum.ops[SCULL_P_RD]);
+	for (d = SCULL_P_RD; d <= SCULL_P_WR; d++)
+		seq_printf(s, "%s blocked %llu times, %llu us, eagain %llu\n",
+			   d == SCULL_P_RD ? "readers" : "writers",
+			   sum.blocked[d],
+			   div_u64(sum.blocked_ns[d], NSEC_PER_USEC),
+			   sum.eagain[d]);
+	seq_printf(s, "fasync signals %llu\n", sum.fasync);
+	if (p->shm) { /* the header goes with the last close */
+		if (down_interruptible(&p->sem))
+			return -ERESTARTSYS;
+		fill = p->hdr ? p->hdr->head - p->hdr->tail : 0;
+		up(&p->sem);
+	} else
+		fill = READ_ONCE(p->head) - READ_ONCE(p->tail);
+	seq_printf(s, "fill %u high water %u\n", fill, READ_ONCE(p->hiwat));
+
+	if (!p->mq && !p->nlanes)
+		scull_p_show_delay(s, &p->lat);
+	for (i = 0; i < p->nlanes; i++) { /* no lock: a snapshot */
+		l = &p->lanes[i];
+		seq_printf(s, "lane %i: fill %u weight %u\n", i,
+			   READ_ONCE(l->head) - READ_ONCE(l->tail),
+			   READ_ONCE(l->weight));
+		scull_p_show_delay(s, &l->lat);
+	}
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(scull_p_stats);
+
+static void scull_p_create_debugfs(void)
+{
+	char name[16];
+	int i;
+
+	scull_p_debugfs = debugfs_create_dir("scullp", NULL);
+	for (i = 0; i < scull_p_nr_devs; i++) {
+		snprintf(name, sizeof(name), "scullpipe%d", i);
+		scull_p_devices[i].debugfs =
+			debugfs_create_file(name, 0444, scull_p_debugfs,
+					    scull_p_devices + i,
+					    &scull_p_stats_fops);
+	}
+}
+
+/*
+ * Change the size of the buffer, keeping the unread data. The indices
+ * don't change: the data is moved to where they point in the new buffer.
+ */
+static long scull_p_resize(struct scull_pipe *dev, unsigned long size)
+{
+	unsigned int oldmask, newmask, idx, n;
+	long retval;
+	char *buffer;
+
+	if (dev->pages || dev->mq || dev->shm || dev->nlanes || size < 2 ||
+	    size > scull_p_max_ring())
+		return -EINVAL; /* only the byte ring is resizable, unmapped */
+	if (dev->records && size < 2 * SCULL_P_RECHDR)
+		return -EINVAL;
+	size = roundup_pow_of_two(size);
+	buffer = kvmalloc(size, GFP_KERNEL);
+	if (!buffer)
+		return -ENOMEM;
+
+	if (down_interruptible(&dev->sem)) {
+		kvfree(buffer);
+		return -ERESTARTSYS;
+	}
+	percpu_down_write(&dev->resize_sem); /* stop SPSC readers and writers */
+	if (dev->head - dev->tail > size) {
+		retval = -EBUSY; /* the unread data would not fit */
+		kvfree(buffer);
+		goto out;
+	}
+
+	oldmask = dev->buffersize - 1;
+	newmask = size - 1;
+	for (idx = dev->tail; idx != dev->head; idx += n) {
+		n = min3(dev->head - idx, oldmask + 1 - (idx & oldmask),
+			 newmask + 1 - (idx & newmask));
+		memcpy(buffer + (idx & newmask), dev->buffer + (idx & oldmask),
+		       n);
+	}
+	kvfree(dev->buffer);
+	dev->buffer = buffer;
+	dev->buffersize = size;
+	WRITE_ONCE(dev->resizes, dev->resizes + 1);
+	retval = size;
+
+out:
+	percpu_up_write(&dev->resize_sem);
+	up(&dev->sem);
+	/* there may be room now, or a record that will never fit */
+	wake_up_interruptible_poll(&dev->outq, EPOLLOUT | EPOLLWRNORM);
+	return retval;
+}
+
+/*
+ * Set a watermark or the flush timeout, returning the old value. The new
+ * setting may be enough to let a sleeper go, so check right away.
+ */
+static long scull_p_set_lowat(struct scull_pipe *dev, unsigned int cmd,
+			      unsigned long arg)
+{
+	unsigned int val = clamp_t(unsigned long, arg, 1, UINT_MAX);
+	long old;
+
+	if (dev->spsc || dev->mq)
+		return -EINVAL; /* these wake on transitions only */
+	if (dev->nlanes)
+		return -EINVAL; /* these wake readers on every write */
+	if ((dev->bcast || dev->records) && cmd == SCULL_P_IOCHRCVLOWAT)
+		return -EINVAL; /* readers are woken on every write */
+	if (dev->bcast && cmd != SCULL_P_IOCHSNDLOWAT)
+		return -EINVAL;
+	if (down_interruptible(&dev->sem))
+		return -ERESTARTSYS;
+	switch (cmd) {
+	case SCULL_P_IOCHRCVLOWAT:
+		old = dev->rcvlowat;
+		dev->rcvlowat = val;
+		break;
+	case SCULL_P_IOCHSNDLOWAT:
+		old = dev->sndlowat;
+		dev->sndlowat = val;
+		break;
+	default: /* SCULL_P_IOCHFLUSH, where 0 is allowed */
+		old = dev->flush_us;
+		dev->flush_us = min_t(unsigned long, arg, UINT_MAX);
+		break;
+	}
+	scull_p_wake_readers(dev);
+	scull_p_wake_writers(dev);
+	up(&dev->sem);
+	return old;
+}
+
+/*
+ * Read as many whole messages as fit in the user's buffer, in one copy:
+ * they are returned as laid out in the ring, headers and padding
+ * included. Returns the number of messages.
+ */
+static long scull_p_read_batch(struct scull_pipe *dev, struct file *filp,
+			       struct scull_p_batch __user *ubatch)
+{
+	struct scull_p_batch batch;
+	unsigned int idx, reclen;
+	long n = 0;
+	int result;
+
+	if (!dev->records)
+		return -EINVAL;
+	if (copy_from_user(&batch, ubatch, sizeof(batch)))
+		return -EFAULT;
+	if (down_interruptible(&dev->sem))
+		return -ERESTARTSYS;
+	result = scull_getreaddata(dev, filp, 1);
+	if (result)
+		return result; /* scull_getreaddata called up(&dev->sem) */
+
+	for (idx = dev->tail; idx != dev->head; idx += reclen, n++) {
+		reclen = scull_p_reclen(*scull_p_rechdr(dev, idx));
+		if (idx - dev->tail + reclen > batch.size)
+			break;
+	}
+	if (!n) {
+		up(&dev->sem);
+		return -EMSGSIZE; /* not even the first one fits */
+	}
+	if (scull_p_copy_out(dev->buffer, dev->buffersize,
+			     u64_to_user_ptr(batch.buf), dev->tail,
+			     idx - dev->tail)) {
+		up(&dev->sem);
+		return -EFAULT;
+	}
+	batch.bytes = idx - dev->tail;
+	dev->tail = idx;
+	dev->copied_out += batch.bytes;
+	dev->msgs_out += n;
+	scull_p_dequeued(dev, batch.bytes, dev->tail, dev->head - dev->tail);
+	scull_p_wake_writers(dev);
+	up(&dev->sem);
+
+	if (put_user(batch.bytes, &ubatch->bytes))
+		return -EFAULT;
+	return n;
+}
+
+/*
+ * The futex-like wait of shm pipes: sleep while the index the peer moves
+ * is still "val". Returns 0 once it moved.
+ */
+static long scull_p_shm_wait(struct scull_pipe *dev, unsigned int cmd,
+			     unsigned long arg)
+{
+	int dir = cmd == SCULL_P_IOCTWAITRD ? SCULL_P_RD : SCULL_P_WR;
+	wait_queue_head_t *wq;
+	unsigned int *idx;
+
+	if (!dev->hdr)
+		return -EINVAL;
+	wq = dir == SCULL_P_RD ? &dev->inq : &dev->outq;
+	idx = dir == SCULL_P_RD ? &dev->hdr->head : &dev->hdr->tail;
+	if (scull_p_wait(dev, dir, *wq, scull_p_moved(dev, idx, arg, dir)))
+		return -ERESTARTSYS;
+	return 0;
+}
+
+/*
+ * Map the header page and the ring of a shm pipe. The mapping holds a
+ * reference to the file, so the ring stays until it is gone.
+ */
+static int scull_p_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct scull_pipe *dev = scull_p_dev(filp);
+
+	if (!dev->hdr)
+		return -ENODEV;
+	if (!(vma->vm_flags & VM_SHARED))
+		return -EINVAL; /* a private copy would share nothing */
+	return remap_vmalloc_range(vma, dev->hdr, vma->vm_pgoff);
+}
+
+/* Set the busy poll budget of a file, returning the old one */
+static long scull_p_set_spin(struct scull_p_fd *pf, unsigned long arg)
+{
+	long old = pf->spin_us;
+
+	if (arg > SCULL_P_MAX_SPIN_US)
+		return -EINVAL;
+	pf->spin_us = pf->spin_cur = arg;
+	return old;
+}
+
 /*
  * The ioctl() implementation
  */
 long scull_p_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
+	struct scull_p_fd *pf = filp->private_data;
+	struct scull_pipe *dev = pf->dev;
+
 	/*
 	 * extract the type and number bitfields, and don't decode
 	 * wrong cmds: return ENOTTY (inappropriate ioctl) before access_ok()
@@ -346,6 +2106,52 @@ long scull_p_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		break;
 	case SCULL_P_IOCQSIZE:
 		return scull_p_buffer;
+	case SCULL_P_IOCHPSIZE:
+		return scull_p_resize(dev, arg);
+	case SCULL_P_IOCQPSIZE:
+		return dev->pages ? scull_p_size(dev) : READ_ONCE(dev->buffersize);
+	case SCULL_P_IOCQFILL:
+		if (dev->mq)
+			return scull_p_mq_fill(dev);
+		if (dev->spsc)
+			return READ_ONCE(*scull_p_headp(dev)) -
+			       READ_ONCE(*scull_p_tailp(dev));
+		return READ_ONCE(dev->head) - READ_ONCE(dev->tail);
+	case SCULL_P_IOCHRCVLOWAT:
+	case SCULL_P_IOCHSNDLOWAT:
+	case SCULL_P_IOCHFLUSH:
+		return scull_p_set_lowat(dev, cmd, arg);
+	case SCULL_P_IOCGQMASK:
+		if (!dev->mq)
+			return -EINVAL;
+		return put_user(scull_p_mq_mask(dev), (__u64 __user *)arg);
+	case SCULL_P_IOCRBATCH:
+		return scull_p_read_batch(dev, filp,
+					  (struct scull_p_batch __user *)arg);
+	case SCULL_P_IOCHSPIN:
+		return scull_p_set_spin(pf, arg);
+	case SCULL_P_IOCTWAITRD:
+	case SCULL_P_IOCTWAITWR:
+		return scull_p_shm_wait(dev, cmd, arg);
+	case SCULL_P_IOCWAKE:
+		if (!dev->hdr)
+			return -EINVAL;
+		scull_p_wake(dev, SCULL_P_RD);
+		scull_p_wake(dev, SCULL_P_WR);
+		scull_p_kill_fasync(dev);
+		return 0;
+	case SCULL_P_IOCQLAG:
+		if (!dev->bcast || !(filp->f_mode & FMODE_READ))
+			return -EINVAL;
+		return READ_ONCE(dev->head) - READ_ONCE(pf->tail);
+	case SCULL_P_IOCHLANE:
+		if (arg >= dev->nlanes)
+			return -EINVAL; /* also when not in lane mode */
+		return xchg(&pf->lane, (int)arg);
+	case SCULL_P_IOCHWEIGHT:
+		return scull_p_set_weight(dev, pf, arg);
+	case SCULL_P_IOCQSPIN:
+		return READ_ONCE(pf->spin_cur);
 	default: /* redundant, as cmd was checked against MAXNR */
 		return -ENOTTY;
 	}
@@ -359,7 +2165,10 @@ static struct file_operations scull_pipe_fops = {
 	.write = scull_p_write,
 	.unlocked_ioctl = scull_p_ioctl,
 	.poll = scull_p_poll,
+	.mmap = scull_p_mmap,
 	.fasync = scull_p_fasync,
+	.splice_read = scull_p_splice_read,
+	.splice_write = scull_p_splice_write,
 	.llseek = no_llseek,
 	.open = scull_p_open,
 	.release = scull_p_release,
@@ -370,6 +2179,9 @@ static struct file_operations scull_pipe_fops = {
  * Thefore, it must be careful to work correctly even if some of the items
  * have not been initialized
  */
+/* How many devices scull_p_init_module() got to set up completely */
+static int scull_p_nr_ready;
+
 void scull_p_cleanup_module(void)
 {
 	int i;
@@ -382,13 +2194,21 @@ void scull_p_cleanup_module(void)
 	if (!scull_p_devices)
 		return; /* nothing else to release */
 
+	debugfs_remove_recursive(scull_p_debugfs);
 	for (i = 0; i < scull_p_nr_devs; i++) {
-		cdev_del(&scull_p_devices[i].cdev);
-		kfree(scull_p_devices[i].buffer);
+		/* a failed init never added the others */
+		if (i < scull_p_nr_ready) {
+			cdev_del(&scull_p_devices[i].cdev);
+			scull_p_free_ring(scull_p_devices + i);
+		}
+		/* both are fine with a device that is still zeroed */
+		percpu_free_rwsem(&scull_p_devices[i].resize_sem);
+		free_percpu(scull_p_devices[i].stats);
 	}
 	kfree(scull_p_devices);
 	unregister_chrdev_region(devno, scull_p_nr_devs);
 	scull_p_devices = NULL; /* pedantic */
+	scull_p_nr_ready = 0;
 }
 
 /*
@@ -410,7 +2230,7 @@ static void scull_p_setup_cdev(struct scull_pipe *dev, int index)
 
 int scull_p_init_module(void)
 {
-	int result, i;
+	int result, i, j;
 	dev_t dev = 0;
 
 	/*
@@ -442,8 +2262,55 @@ int scull_p_init_module(void)
 		init_waitqueue_head(&(scull_p_devices[i].inq));
 		init_waitqueue_head(&(scull_p_devices[i].outq));
 		sema_init(&scull_p_devices[i].sem, 1);
+		result = percpu_init_rwsem(&scull_p_devices[i].resize_sem);
+		if (result)
+			goto fail;
+		scull_p_devices[i].stats = alloc_percpu(struct scull_p_stats);
+		if (!scull_p_devices[i].stats) {
+			result = -ENOMEM;
+			goto fail;
+		}
+		scull_p_devices[i].pages = scull_p_pages;
+		scull_p_devices[i].mq = scull_p_mq && !scull_p_pages;
+		if (scull_p_lanes > 1 && !scull_p_pages && !scull_p_mq)
+			scull_p_devices[i].nlanes = min(scull_p_lanes,
+							SCULL_P_MAX_LANES);
+		for (j = 0; j < scull_p_devices[i].nlanes; j++) {
+			init_waitqueue_head(&scull_p_devices[i].lanes[j].outq);
+			scull_p_devices[i].lanes[j].weight = SCULL_P_LANE_QUANTUM
+				<< (scull_p_devices[i].nlanes - 1 - j);
+		}
+		scull_p_devices[i].records = scull_p_records && !scull_p_pages &&
+					     !scull_p_mq &&
+					     !scull_p_devices[i].nlanes;
+		scull_p_devices[i].bcast = scull_p_bcast && !scull_p_pages &&
+					   !scull_p_mq &&
+					   !scull_p_devices[i].nlanes &&
+					   !scull_p_devices[i].records;
+		INIT_LIST_HEAD(&scull_p_devices[i].readers);
+		scull_p_devices[i].persist = scull_p_persist;
+		/* broadcast, lane and record readers: on every write */
+		scull_p_devices[i].rcvlowat = max(scull_p_rcvlowat, 1);
+		if (scull_p_devices[i].bcast || scull_p_devices[i].nlanes ||
+		    scull_p_devices[i].records)
+			scull_p_devices[i].rcvlowat = 1;
+		scull_p_devices[i].sndlowat = max(scull_p_sndlowat, 1);
+		scull_p_devices[i].rwant = UINT_MAX; /* nobody asleep */
+		scull_p_devices[i].flush_us = max(scull_p_flush_us, 0);
+		hrtimer_init(&scull_p_devices[i].flush_timer, CLOCK_MONOTONIC,
+			     HRTIMER_MODE_REL);
+		scull_p_devices[i].flush_timer.function = scull_p_flush;
+		/* the page ring is always locked */
+		scull_p_devices[i].spsc = (scull_p_spsc || scull_p_shm) &&
+					  !scull_p_pages && !scull_p_mq &&
+					  !scull_p_devices[i].nlanes &&
+					  !scull_p_records && !scull_p_bcast;
+		scull_p_devices[i].shm = scull_p_shm &&
+					 scull_p_devices[i].spsc;
 		scull_p_setup_cdev(scull_p_devices + i, i);
+		scull_p_nr_ready = i + 1;
 	}
+	scull_p_create_debugfs();
 
 #ifdef SCULL_P_DEBUG
 	scull_p_create_proc();
@@ -12,6 +12,13 @@
 #include <linux/fs.h> /* needed for fasync_struct */
 #include <linux/cdev.h>
 #include <linux/semaphore.h>
+#include <linux/cache.h> /* ____cacheline_aligned_in_smp */
+#include <linux/percpu-rwsem.h>
+#include <linux/mm_types.h> /* struct page */
+#include <linux/hrtimer.h>
+#include <linux/types.h> /* __u64 */
+#include <linux/atomic.h>
+#include <linux/list.h>
 
 /*
  * Macros to help debugging
@@ -41,28 +48,307 @@
 #endif
 
 /*
- * The pipe device is a simple circular buffer. Here is its default size.
+ * The pipe device is a simple circular buffer. Here is its default size,
+ * rounded up to a power of two when the buffer is allocated.
  */
 #ifndef SCULL_P_BUFFER
 #define SCULL_P_BUFFER 4000
 #endif
 
+/*
+ * A pipe can be resized up to this many bytes. Buffers larger than a few
+ * pages come from vmalloc(), so MB sized pipes don't need contiguous memory.
+ */
+#ifndef SCULL_P_MAX_BUFFER
+#define SCULL_P_MAX_BUFFER (16 << 20)
+#endif
+
+/*
+ * Readers are woken once the data has waited this long, even if there is
+ * less of it than their low watermark asks for (0 disables the timer).
+ */
+#ifndef SCULL_P_FLUSH_US
+#define SCULL_P_FLUSH_US 1000
+#endif
+
+/*
+ * A reader may busy poll for at most this long before it sleeps.
+ */
+#ifndef SCULL_P_MAX_SPIN_US
+#define SCULL_P_MAX_SPIN_US 1000
+#endif
+
+/*
+ * In record mode each message is preceded by a __u32 length in the ring,
+ * and padded to a multiple of it.
+ */
+#define SCULL_P_RECHDR sizeof(__u32)
+
+/*
+ * In page mode the pipe is a ring of page slots instead, at least this
+ * many of them (like the 16 pipe_buffers of a real pipe).
+ */
+#ifndef SCULL_P_MIN_SLOTS
+#define SCULL_P_MIN_SLOTS 16
+#endif
+
+/*
+ * Queueing delays are kept in a histogram with power of two buckets:
+ * bucket 0 counts delays under 1us, bucket n those from 2^(n-1) to 2^n us,
+ * and the last bucket everything above. The delay is sampled with one
+ * timestamp per write, and at most SCULL_P_MARKS writes can wait for
+ * their reader at once; the others go unsampled.
+ */
+#define SCULL_P_HIST 16
+#define SCULL_P_MARKS 64
+
+/*
+ * A pipe in lane mode has this many lanes at most. Lane 0 has the
+ * highest priority; each lane is served up to its weight, in bytes, per
+ * round, which is by default SCULL_P_LANE_QUANTUM for the last lane and
+ * doubles with every lane above it.
+ */
+#define SCULL_P_MAX_LANES 4
+#ifndef SCULL_P_LANE_QUANTUM
+#define SCULL_P_LANE_QUANTUM 4096
+#endif
+
 /*
  * The different configurable parameters
  */
 extern int scull_major;
 extern int scull_nr_devs;
 extern int scull_p_buffer;
+extern int scull_p_max_buffer;
+extern int scull_p_spsc;
+extern int scull_p_shm;
+extern int scull_p_pages;
+extern int scull_p_mq;
+extern int scull_p_records;
+extern int scull_p_bcast;
+extern int scull_p_persist;
+extern int scull_p_lanes;
+extern int scull_p_rcvlowat;
+extern int scull_p_sndlowat;
+extern int scull_p_flush_us;
+
+/*
+ * The header page of a shared memory (shm) pipe, which mmap() maps at
+ * offset 0, followed by "size" bytes of ring at offset "offset". The
+ * producer owns "head" and "wwait", the consumer "tail" and "rwait", and
+ * they use them like SPSC pipes do, whether they are processes that
+ * mapped the ring or read() and write() working on it in the kernel.
+ *
+ * A side that sleeps sets its flag before it checks the peer's index one
+ * last time, and the peer, having published its own index, issues a full
+ * barrier and calls SCULL_P_IOCWAKE if it finds the flag set. Like with
+ * futexes, nobody makes a system call while no one waits. The check
+ * follows every publish, not only the empty and full transitions, since
+ * a waiter may want more than the next byte; read() and write() do the
+ * same for mapped peers.
+ */
+struct scull_p_shm_hdr {
+	__u32 head __attribute__((aligned(64)));
+	__u32 wwait; /* a producer waits for room */
+	__u32 tail __attribute__((aligned(64)));
+	__u32 rwait; /* a consumer waits for data */
+	__u32 size __attribute__((aligned(64))); /* a power of two */
+	__u32 offset; /* of the ring in the mapping */
+};
+
+/*
+ * One slot of a page mode pipe: "len" bytes at "offset" in "page", on
+ * which the slot holds a reference. Pages we allocated ourselves are
+ * OWNED and write() appends to the last one while it has room; pages
+ * spliced in belong to somebody else and are never written to.
+ */
+struct scull_p_slot {
+	struct page *page;
+	unsigned int offset, len;
+	unsigned int flags;
+};
+
+#define SCULL_P_SLOT_OWNED 0x1
+
+/*
+ * Per-pipe statistics, one copy per cpu. Index them with SCULL_P_RD or
+ * SCULL_P_WR.
+ */
+enum { SCULL_P_RD, SCULL_P_WR };
+
+struct scull_p_stats {
+	u64 bytes[2], ops[2]; /* data moved, and the calls that moved it */
+	u64 blocked[2], blocked_ns[2]; /* sleeps for data or room */
+	u64 eagain[2]; /* non-blocking calls that found nothing to do */
+	u64 fasync; /* SIGIO sent */
+};
+
+/* Where a write ended in the ring, and when it was done */
+struct scull_p_mark {
+	unsigned int idx;
+	u64 ns;
+};
+
+/*
+ * The queueing delay of a ring: the producer pushes a mark at the end of
+ * each write, a ring it shares with the consumer the way SPSC pipes share
+ * the data, and the consumer pops the marks it read past into "hist".
+ */
+struct scull_p_delay {
+	struct scull_p_mark marks[SCULL_P_MARKS]; /* writes not read yet */
+	unsigned int mhead, mtail; /* free running, like head and tail */
+	unsigned long unmarked; /* writes not sampled: no mark left */
+	unsigned long hist[SCULL_P_HIST];
+};
+
+/*
+ * One lane of a lane mode pipe: a byte ring of its own, protected by the
+ * pipe's semaphore. "credit" is what is left of "weight" in this round.
+ */
+struct scull_p_lane {
+	wait_queue_head_t outq; /* writers waiting for room here */
+	char *buffer; /* dev->buffersize bytes */
+	unsigned int head, tail; /* free running, like the pipe's own */
+	unsigned int weight; /* bytes per round */
+	int credit;
+	struct scull_p_delay lat;
+};
+
+/*
+ * One queue of a multi-queue pipe. There is one per cpu, allocated with
+ * alloc_percpu(), and a writer appends to the queue of the cpu it runs
+ * on: "sem" is only shared with the writers that started on the same
+ * cpu, and with a reader while it drains the queue.
+ */
+struct scull_p_queue {
+	struct semaphore sem;
+	wait_queue_head_t outq; /* writers waiting for room here */
+	char *buffer; /* dev->buffersize bytes */
+	unsigned int head, tail; /* free running, like the pipe's own */
+};
 
+/*
+ * "head" and "tail" are free running indices: the producer advances head,
+ * the consumer advances tail, head - tail bytes are in the buffer and
+ * (index & (buffersize - 1)) is the offset of an index in the buffer.
+ *
+ * In SPSC (single producer, single consumer) mode the device accepts one
+ * reader and one writer only. They then share nothing but the two indices,
+ * published with release/acquire ordering, and take no lock at all. The
+ * indices live on cache lines of their own so the two sides don't bounce
+ * a line back and forth on every update. Resizing has to stop both of
+ * them, so they hold "resize_sem" for reading, which costs a per-cpu
+ * increment, while they touch the buffer.
+ *
+ * In page mode "buffer" is unused and the data sits in "slots", a ring of
+ * nslots (a power of two) page references indexed by the free running
+ * "shead" and "stail". head and tail still count bytes, so the fill level
+ * is computed the same way. Data written with write() is copied into
+ * pages of our own; data spliced in is kept by reference, and so is data
+ * spliced out. The four counters tell the two paths apart.
+ *
+ * The locked modes batch their wakeups, like SO_RCVLOWAT and SO_SNDLOWAT:
+ * readers are woken when rcvlowat bytes are there, writers when sndlowat
+ * bytes are free. Whatever sits below the mark longer than flush_us is
+ * flushed by "flush_timer", which sets "rflush" until the pipe drains.
+ * SPSC pipes only wake on the empty and full transitions and don't use
+ * the marks.
+ *
+ * In multi-queue mode "buffer" is unused too: writers append to per-cpu
+ * "queues" instead, and readers, serialized by "sem", drain them round
+ * robin starting after "rr", the last queue they served. Ordering is only
+ * kept among the writes that went through the same queue. Like SPSC, the
+ * mode wakes on transitions and doesn't use the marks.
+ *
+ * In shm mode the pipe is an SPSC pipe whose indices are in "hdr", the
+ * header of the buffer user space can map: head and tail are unused.
+ * Both sides open it read-write to map it, so the producer can't be told
+ * apart at open time; instead the first file to write() claims
+ * "shm_wbusy" until it is closed, and other files get -EBUSY. Nothing
+ * stops a mapped producer from racing it: that is up to user space.
+ *
+ * In broadcast mode every reader has a cursor of its own over the byte
+ * ring, and "tail" is the cursor of the slowest one: the data stays
+ * until all the readers have read it. A new reader starts at tail, with
+ * the oldest data still there.
+ *
+ * Record mode uses the byte ring, but keeps the boundaries of the writes:
+ * see scull_p_take_record() for the layout. Its readers are woken by
+ * every message, as a writer waiting for room for a whole one may never
+ * fill the pipe: rcvlowat stays 1.
+ *
+ * In lane mode "buffer" is unused: every lane has a ring of its own, and
+ * head and tail only add up what went through all of them. A writer
+ * uses the lane set on its file, a reader takes from one lane per read,
+ * the first one in priority order that has data and credit left. When
+ * none has, every lane gets its weight back and a new round starts: the
+ * lanes below get their share even when the ones above are never empty.
+ *
+ * Every mode keeps "stats", and all but multi-queue sample the queueing
+ * delay in "lat"; lane mode samples each lane on its own instead.
+ */
 struct scull_pipe {
 	wait_queue_head_t inq, outq; /* read and write queues */
-	char *buffer, *end; /* begin of buf, end of buf */
-	int buffersize; /* used in pointer arithmetic */
-	char *rp, *wp; /* where to read, where to write */
+	char *buffer; /* begin of buf */
+	unsigned int buffersize; /* a power of two */
+	int spsc; /* lockless single producer/single consumer mode */
+	int shm; /* SPSC, with the ring and indices in shared memory */
+	struct scull_p_shm_hdr *hdr; /* shm: the header page, then the ring */
+	int pages; /* page ring mode, needed for splice */
+	int mq; /* multi-queue mode, one ring per cpu */
+	struct scull_p_queue __percpu *queues; /* mq: the rings */
+	unsigned int rr; /* mq: where the next read starts */
+	int records; /* record mode: one message per read */
+	int bcast; /* broadcast mode: every reader reads everything */
+	struct list_head readers; /* bcast: their scull_p_fd, by "list" */
+	int persist; /* keep the ring when the last file is closed */
+	unsigned long msgs_in, msgs_out, truncated; /* record mode */
+	struct scull_p_slot *slots; /* page mode: the ring of slots */
+	unsigned int nslots, shead, stail; /* page mode: a power of two */
+	unsigned long copied_in, copied_out; /* bytes moved by copy */
+	unsigned long spliced_in, spliced_out; /* bytes moved by reference */
+	unsigned int rcvlowat, sndlowat; /* wakeup watermarks, in bytes */
+	unsigned int flush_us; /* max time data waits below rcvlowat */
+	int rflush; /* the timer expired: readers may take anything */
+	unsigned int rwant, rgen; /* smallest want asleep; wakeups so far */
+	struct hrtimer flush_timer;
+	unsigned long rwakeups, rbatched; /* reader wakeups done and saved */
+	unsigned long wwakeups, wbatched; /* writer wakeups done and saved */
+	unsigned long flushes; /* reader wakeups done by the timer */
+	atomic_long_t spins, spin_hits; /* busy polls, and how many paid */
+	atomic_long_t spin_ns; /* time spent in them */
+	struct scull_p_stats __percpu *stats;
+	unsigned int hiwat; /* the highest fill level seen */
+	struct scull_p_delay lat; /* all but mq and lane mode */
+	int nlanes; /* lane mode: priority lanes, 0 is the highest */
+	struct scull_p_lane lanes[SCULL_P_MAX_LANES];
+	struct dentry *debugfs;
 	int nreaders, nwriters; /* number of openings for r/w */
+	unsigned long shm_wbusy; /* shm: bit 0, a file does write() */
 	struct fasync_struct *async_queue; /* asynchronous readers */
 	struct semaphore sem; /* mutual exclusion semaphore */
+	struct percpu_rw_semaphore resize_sem; /* SPSC: buffer vs. resize */
+	unsigned int resizes; /* bumped under resize_sem, for SPSC writers */
 	struct cdev cdev; /* Char device structure */
+	unsigned int head ____cacheline_aligned_in_smp; /* where to write */
+	unsigned int tail ____cacheline_aligned_in_smp; /* where to read */
+};
+
+/*
+ * What we keep per open file: filp->private_data points here. A reader
+ * with a busy poll budget spins up to "spin_cur" microseconds for data
+ * before it sleeps. spin_cur doubles, up to spin_us, when spinning paid
+ * off and halves when it didn't, so a slow writer costs little CPU.
+ * Readers of a broadcast pipe also keep their cursor here.
+ */
+struct scull_p_fd {
+	struct scull_pipe *dev;
+	unsigned int spin_us; /* the budget set with SCULL_P_IOCHSPIN */
+	unsigned int spin_cur; /* the budget in use */
+	unsigned int tail; /* bcast: where this reader is */
+	struct list_head list; /* bcast: in dev->readers */
+	int lane; /* lane mode: where this file writes */
+	int producer; /* shm: this file holds shm_wbusy */
 };
 
 int scull_p_init(dev_t dev);
@@ -73,6 +359,12 @@ long scull_p_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
  * Ioctl definitions
  */
 
+struct scull_p_batch {
+	__u64 buf; /* user buffer */
+	__u32 size; /* its size */
+	__u32 bytes; /* returned: how much was filled */
+};
+
 /* Use '0xDF' as magic number */
 #define SCULL_IOC_MAGIC 0xDF
 
@@ -81,11 +373,62 @@ long scull_p_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
 /*
  * T means "Tell" directly with the argument value
  * Q means "Query": response is on the return value
+ * G means "Get": reply by setting through a pointer
+ * H means "sHift": T and Q atomically
+ *
+ * SCULL_P_IOCTSIZE and SCULL_P_IOCQSIZE handle the default size of new
+ * buffers. The rest apply to the pipe the ioctl is issued on: the size
+ * of its buffer, which can be changed without losing unread data (like
+ * F_SETPIPE_SZ), and how many bytes are waiting in it.
+ *
+ * The H commands set the wakeup watermarks and the flush timeout of the
+ * pipe and return the old value.
+ *
+ * SCULL_P_IOCGQMASK returns, for a multi-queue pipe, a bitmask of the
+ * queues with data in them: bit n for the queue of cpu n, for the first
+ * 64 cpus.
+ *
+ * SCULL_P_IOCHSPIN sets the busy poll budget of the file descriptor, in
+ * microseconds (0 turns it off), and SCULL_P_IOCQSPIN returns what the
+ * adaptive budget currently is.
+ *
+ * The shm pipes add three commands. SCULL_P_IOCTWAITRD sleeps until
+ * the head of the ring is no longer the one passed, SCULL_P_IOCTWAITWR
+ * until the tail is no longer the one passed; both set their flag in the
+ * header first. SCULL_P_IOCWAKE clears the flags and wakes every waiter.
+ *
+ * SCULL_P_IOCQLAG returns how many bytes a reader of a broadcast pipe
+ * has yet to read. SCULL_P_IOCQFILL returns the same for the slowest one.
+ *
+ * SCULL_P_IOCHLANE sets the lane the writes of a file go to in lane
+ * mode, and SCULL_P_IOCHWEIGHT the weight of that lane, in bytes per
+ * round.
+ *
+ * SCULL_P_IOCRBATCH reads as many whole messages from a record mode
+ * pipe as fit in "size" bytes at "buf", each as a __u32 length followed
+ * by the data padded to 4 bytes. It returns how many messages it read
+ * and sets "bytes" to how much of the buffer it used.
  */
 #define SCULL_P_IOCTSIZE _IO(SCULL_IOC_MAGIC, 1)
 #define SCULL_P_IOCQSIZE _IO(SCULL_IOC_MAGIC, 2)
+#define SCULL_P_IOCHPSIZE _IO(SCULL_IOC_MAGIC, 3)
+#define SCULL_P_IOCQPSIZE _IO(SCULL_IOC_MAGIC, 4)
+#define SCULL_P_IOCQFILL _IO(SCULL_IOC_MAGIC, 5)
+#define SCULL_P_IOCHRCVLOWAT _IO(SCULL_IOC_MAGIC, 6)
+#define SCULL_P_IOCHSNDLOWAT _IO(SCULL_IOC_MAGIC, 7)
+#define SCULL_P_IOCHFLUSH _IO(SCULL_IOC_MAGIC, 8)
+#define SCULL_P_IOCGQMASK _IOR(SCULL_IOC_MAGIC, 9, __u64)
+#define SCULL_P_IOCRBATCH _IOWR(SCULL_IOC_MAGIC, 10, struct scull_p_batch)
+#define SCULL_P_IOCHSPIN _IO(SCULL_IOC_MAGIC, 11)
+#define SCULL_P_IOCQSPIN _IO(SCULL_IOC_MAGIC, 12)
+#define SCULL_P_IOCTWAITRD _IO(SCULL_IOC_MAGIC, 13)
+#define SCULL_P_IOCTWAITWR _IO(SCULL_IOC_MAGIC, 14)
+#define SCULL_P_IOCWAKE _IO(SCULL_IOC_MAGIC, 15)
+#define SCULL_P_IOCQLAG _IO(SCULL_IOC_MAGIC, 16)
+#define SCULL_P_IOCHLANE _IO(SCULL_IOC_MAGIC, 17)
+#define SCULL_P_IOCHWEIGHT _IO(SCULL_IOC_MAGIC, 18)
 /* ... more to come */
 
-#define SCULL_IOC_MAXNR 2
+#define SCULL_IOC_MAXNR 18
 
 #endif /* _SCULL_H_ */
@@ -0,0 +1,386 @@
+/*
+ * scullp_bench.c -- user space benchmarks for scullpipe
+ *
+ * usage: scullp_bench pingpong [rounds] [spin_us]
+ *        scullp_bench shm [messages] [msgsize]
+ *
+ * pingpong bounces a byte between two processes, through scullpipe0 one
+ * way and scullpipe1 the other, and prints the round trip latencies: once
+ * with readers that sleep right away, then with a busy poll budget of
+ * spin_us (50 by default) set with SCULL_P_IOCHSPIN on both sides.
+ *
+ * shm needs the module loaded with scull_p_shm=1. It sends "messages"
+ * messages of "msgsize" bytes (1000000 of 64 by default) from one process
+ * to another through scullpipe0 and prints how many went by per second:
+ * once with a write() per message and read()s of whatever is there, then
+ * with both sides working on the mapped ring and calling into the kernel
+ * only to sleep and to wake the other up.
+ *
+ * The initramfs has no C library, so build it static with
+ * "make scullp_bench" and load the module with scullp_load first.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <linux/ioctl.h>
+
+/* from scullp.h, which only builds in the kernel */
+#define SCULL_IOC_MAGIC 0xDF
+#define SCULL_P_IOCQPSIZE _IO(SCULL_IOC_MAGIC, 4)
+#define SCULL_P_IOCHSPIN _IO(SCULL_IOC_MAGIC, 11)
+#define SCULL_P_IOCTWAITRD _IO(SCULL_IOC_MAGIC, 13)
+#define SCULL_P_IOCTWAITWR _IO(SCULL_IOC_MAGIC, 14)
+#define SCULL_P_IOCWAKE _IO(SCULL_IOC_MAGIC, 15)
+
+struct scull_p_shm_hdr {
+	uint32_t head __attribute__((aligned(64)));
+	uint32_t wwait;
+	uint32_t tail __attribute__((aligned(64)));
+	uint32_t rwait;
+	uint32_t size __attribute__((aligned(64)));
+	uint32_t offset;
+};
+
+#define PIPE0 "/dev/scullpipe0"
+#define PIPE1 "/dev/scullpipe1"
+#define WARMUP 1000
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int open_pipe(const char *name, int flags, int spin_us)
+{
+	int fd = open(name, flags);
+
+	if (fd < 0) {
+		perror(name);
+		exit(1);
+	}
+	if ((flags & O_ACCMODE) == O_RDONLY &&
+	    ioctl(fd, SCULL_P_IOCHSPIN, spin_us) < 0) {
+		perror("SCULL_P_IOCHSPIN");
+		exit(1);
+	}
+	return fd;
+}
+
+/* Move one byte, or die trying */
+static void xfer(int fd, char *c, int out)
+{
+	ssize_t n;
+
+	do {
+		n = out ? write(fd, c, 1) : read(fd, c, 1);
+	} while (n < 0 && errno == EINTR);
+	if (n != 1) {
+		perror(out ? "write" : "read");
+		exit(1);
+	}
+}
+
+static int cmp_ll(const void *a, const void *b)
+{
+	long long x = *(const long long *)a, y = *(const long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Run "rounds" round trips and print their percentiles, in us */
+static void pingpong(int rounds, int spin_us)
+{
+	long long *lat, t;
+	int in, out, i, status;
+	char c = 0;
+	pid_t pid;
+
+	lat = malloc(rounds * sizeof(*lat));
+	if (!lat) {
+		perror("malloc");
+		exit(1);
+	}
+	fflush(stdout); /* or the child prints it again */
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		exit(1);
+	}
+	if (pid == 0) { /* the echo side */
+		in = open_pipe(PIPE0, O_RDONLY, spin_us);
+		out = open_pipe(PIPE1, O_WRONLY, spin_us);
+		for (i = 0; i < WARMUP + rounds; i++) {
+			xfer(in, &c, 0);
+			xfer(out, &c, 1);
+		}
+		exit(0);
+	}
+	out = open_pipe(PIPE0, O_WRONLY, spin_us);
+	in = open_pipe(PIPE1, O_RDONLY, spin_us);
+	for (i = 0; i < WARMUP + rounds; i++) {
+		t = now_ns();
+		xfer(out, &c, 1);
+		xfer(in, &c, 0);
+		if (i >= WARMUP)
+			lat[i - WARMUP] = now_ns() - t;
+	}
+	close(in);
+	close(out);
+	waitpid(pid, &status, 0);
+
+	qsort(lat, rounds, sizeof(*lat), cmp_ll);
+	printf("%-8d %8d %9.1f %9.1f %9.1f %9.1f\n", spin_us, rounds,
+	       lat[rounds / 2] / 1000.0, lat[rounds * 90 / 100] / 1000.0,
+	       lat[rounds * 99 / 100] / 1000.0, lat[rounds - 1] / 1000.0);
+	free(lat);
+}
+
+/*
+ * The mapped side of shm: a header, and a ring of hdr->size bytes. The
+ * indices run free and are published with release stores; a side that
+ * publishes then checks the peer's wait flag, after a full barrier, and
+ * wakes it if it is set. The kernel sets our flag when we sleep.
+ */
+struct shm_map {
+	int fd;
+	struct scull_p_shm_hdr *hdr;
+	char *ring;
+	size_t len;
+};
+
+static void shm_map(struct shm_map *m)
+{
+	long size;
+
+	m->fd = open_pipe(PIPE0, O_RDWR, 0);
+	size = ioctl(m->fd, SCULL_P_IOCQPSIZE);
+	if (size < 0) {
+		perror("SCULL_P_IOCQPSIZE");
+		exit(1);
+	}
+	m->len = sysconf(_SC_PAGESIZE) + size;
+	m->hdr = mmap(NULL, m->len, PROT_READ | PROT_WRITE, MAP_SHARED,
+		      m->fd, 0);
+	if (m->hdr == MAP_FAILED) {
+		perror("mmap (is scull_p_shm set?)");
+		exit(1);
+	}
+	m->ring = (char *)m->hdr + m->hdr->offset;
+}
+
+/* Tell the peer we published, if it sleeps */
+static void shm_kick(struct shm_map *m, uint32_t *flag)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(flag, __ATOMIC_RELAXED) &&
+	    ioctl(m->fd, SCULL_P_IOCWAKE) < 0) {
+		perror("SCULL_P_IOCWAKE");
+		exit(1);
+	}
+}
+
+static void shm_sleep(struct shm_map *m, unsigned long cmd, uint32_t val)
+{
+	if (ioctl(m->fd, cmd, val) < 0 && errno != EINTR) {
+		perror("shm wait");
+		exit(1);
+	}
+}
+
+static void shm_produce(long messages, int msgsize)
+{
+	uint32_t head, tail, size, off, first, len = msgsize;
+	struct shm_map m;
+	char *msg;
+	long i;
+
+	shm_map(&m);
+	size = m.hdr->size;
+	if (len > size) {
+		fprintf(stderr, "msgsize is over the ring size, %u\n", size);
+		exit(1);
+	}
+	msg = calloc(1, len);
+	head = m.hdr->head;
+	for (i = 0; i < messages; i++) {
+		for (;;) { /* wait for room for the whole message */
+			tail = __atomic_load_n(&m.hdr->tail, __ATOMIC_ACQUIRE);
+			if (size - (head - tail) >= len)
+				break;
+			shm_sleep(&m, SCULL_P_IOCTWAITWR, tail);
+		}
+		off = head & (size - 1);
+		first = size - off < len ? size - off : len;
+		memcpy(m.ring + off, msg, first);
+		memcpy(m.ring, msg + first, len - first); /* wrapped */
+		head += len;
+		__atomic_store_n(&m.hdr->head, head, __ATOMIC_RELEASE);
+		shm_kick(&m, &m.hdr->rwait);
+	}
+	free(msg);
+	munmap(m.hdr, m.len);
+	close(m.fd);
+}
+
+static void shm_consume(long messages, int msgsize)
+{
+	unsigned long long left = (unsigned long long)messages * msgsize;
+	uint32_t head, tail, size, off, n, first;
+	struct shm_map m;
+	char *buf;
+
+	shm_map(&m);
+	size = m.hdr->size;
+	buf = malloc(size);
+	tail = m.hdr->tail;
+	while (left) {
+		head = __atomic_load_n(&m.hdr->head, __ATOMIC_ACQUIRE);
+		if (head == tail) {
+			shm_sleep(&m, SCULL_P_IOCTWAITRD, tail);
+			continue;
+		}
+		n = head - tail; /* all there is: a reader takes it in bulk */
+		off = tail & (size - 1);
+		first = size - off < n ? size - off : n;
+		memcpy(buf, m.ring + off, first);
+		memcpy(buf + first, m.ring, n - first); /* wrapped */
+		tail += n;
+		__atomic_store_n(&m.hdr->tail, tail, __ATOMIC_RELEASE);
+		shm_kick(&m, &m.hdr->wwait);
+		left -= n;
+	}
+	free(buf);
+	munmap(m.hdr, m.len);
+	close(m.fd);
+}
+
+static void rw_produce(long messages, int msgsize)
+{
+	int fd = open_pipe(PIPE0, O_WRONLY, 0);
+	char *msg = calloc(1, msgsize);
+	ssize_t n, done;
+	long i;
+
+	for (i = 0; i < messages; i++) {
+		for (done = 0; done < msgsize; done += n) {
+			n = write(fd, msg + done, msgsize - done);
+			if (n < 0 && errno == EINTR)
+				n = 0;
+			else if (n <= 0) {
+				perror("write");
+				exit(1);
+			}
+		}
+	}
+	free(msg);
+	close(fd);
+}
+
+static void rw_consume(long messages, int msgsize)
+{
+	unsigned long long left = (unsigned long long)messages * msgsize;
+	int fd = open_pipe(PIPE0, O_RDONLY, 0);
+	char buf[65536];
+	ssize_t n;
+
+	while (left) {
+		n = read(fd, buf, sizeof(buf));
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			perror("read");
+			exit(1);
+		}
+		left -= n;
+	}
+	close(fd);
+}
+
+/* Send the messages one way, and print how many per second went by */
+static void shm_bench(const char *name, long messages, int msgsize,
+		      void (*produce)(long, int), void (*consume)(long, int))
+{
+	long long t;
+	int status, hold;
+	pid_t pid;
+
+	/* keeps the ring while neither side has it open yet, or any more */
+	hold = open_pipe(PIPE0, O_RDONLY, 0);
+	fflush(stdout);
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		exit(1);
+	}
+	t = now_ns();
+	if (pid == 0) {
+		consume(messages, msgsize);
+		exit(0);
+	}
+	produce(messages, msgsize);
+	waitpid(pid, &status, 0); /* done when it's all been read */
+	t = now_ns() - t;
+	close(hold);
+	if (!WIFEXITED(status) || WEXITSTATUS(status))
+		exit(1);
+	printf("%-8s %9ld %7d %12.0f %9.1f\n", name, messages, msgsize,
+	       messages * 1e9 / t, (double)messages * msgsize * 1e3 / t);
+}
+
+static int usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s pingpong [rounds] [spin_us]\n"
+		"       %s shm [messages] [msgsize]\n", prog, prog);
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	int rounds, spin_us, msgsize;
+	long messages;
+
+	if (argc < 2)
+		return usage(argv[0]);
+	if (!strcmp(argv[1], "shm")) {
+		messages = argc > 2 ? atol(argv[2]) : 1000000;
+		msgsize = argc > 3 ? atoi(argv[3]) : 64;
+		if (messages < 1 || msgsize < 1) {
+			fprintf(stderr, "%s: bad messages or msgsize\n",
+				argv[0]);
+			return 1;
+		}
+		printf("%-8s %9s %7s %12s %9s\n",
+		       "path", "messages", "msgsize", "msgs/s", "MB/s");
+		shm_bench("rw", messages, msgsize, rw_produce, rw_consume);
+		shm_bench("mmap", messages, msgsize, shm_produce, shm_consume);
+		return 0;
+	}
+	if (strcmp(argv[1], "pingpong"))
+		return usage(argv[0]);
+
+	rounds = argc > 2 ? atoi(argv[2]) : 100000;
+	spin_us = argc > 3 ? atoi(argv[3]) : 50;
+	if (rounds < 1 || spin_us < 0) {
+		fprintf(stderr, "%s: bad rounds or spin_us\n", argv[0]);
+		return 1;
+	}
+
+	printf("%-8s %8s %9s %9s %9s %9s\n",
+	       "spin_us", "rounds", "p50", "p90", "p99", "max");
+	pingpong(rounds, 0);
+	if (spin_us)
+		pingpong(rounds, spin_us);
+	return 0;
+}
@@ -0,0 +1,54 @@
+/*
+ * scullp_trace.h - scull pipe tracepoints.
+ *
+ * Every transfer in or out of a pipe, with how much is queued after it:
+ *
+ *     echo 1 > /sys/kernel/tracing/events/scullp/enable
+ *     cat /sys/kernel/tracing/trace_pipe
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM scullp
+
+#if !defined(_SCULLP_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define _SCULLP_TRACE_H_
+
+#include <linux/tracepoint.h>
+
+DECLARE_EVENT_CLASS(scullp_xfer,
+	TP_PROTO(int minor, size_t bytes, unsigned int fill),
+	TP_ARGS(minor, bytes, fill),
+
+	TP_STRUCT__entry(
+		__field(int, minor)
+		__field(size_t, bytes)
+		__field(unsigned int, fill)
+	),
+
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->bytes = bytes;
+		__entry->fill = fill;
+	),
+
+	TP_printk("scullpipe%d bytes=%zu fill=%u", __entry->minor,
+		  __entry->bytes, __entry->fill)
+);
+
+DEFINE_EVENT(scullp_xfer, scullp_enqueue,
+	TP_PROTO(int minor, size_t bytes, unsigned int fill),
+	TP_ARGS(minor, bytes, fill)
+);
+
+DEFINE_EVENT(scullp_xfer, scullp_dequeue,
+	TP_PROTO(int minor, size_t bytes, unsigned int fill),
+	TP_ARGS(minor, bytes, fill)
+);
+
+#endif /* _SCULLP_TRACE_H_ */
+
+/* This part must be outside the include guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE scullp_trace
+#include <trace/define_trace.h>
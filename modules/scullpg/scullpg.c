@@ -15,6 +15,16 @@
 #include <linux/proc_fs.h>
 #include <linux/seq_file.h>
 #include <linux/fcntl.h> /* O_ACCMODE */
+#include <linux/gfp.h> /* __get_free_pages() */
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/huge_mm.h>
+#include <linux/pfn_t.h>
+#include <linux/dma-buf.h>
+#include <linux/dma-mapping.h>
+#include <linux/iosys-map.h>
+#include <linux/scatterlist.h>
 #include <asm/uaccess.h>
 
 #include "scullpg.h" /* local definitions */
@@ -23,15 +33,25 @@ int scullpg_major = SCULLPG_MAJOR;
 int scullpg_devs = SCULLPG_DEVS; /* number of bare scullpg devices */
 int scullpg_qset = SCULLPG_QSET;
 int scullpg_order = SCULLPG_ORDER;
+int scullpg_min_order = SCULLPG_MIN_ORDER;
+int scullpg_dma32 = 0; /* allocate below 4GB for 32-bit DMA importers */
 
 module_param(scullpg_major, int, 0);
 module_param(scullpg_devs, int, 0);
 module_param(scullpg_qset, int, 0);
-module_param(scullpg_order, int, 0);
+/*
+ * The orders can be tuned at runtime through /sys/module/scullpg/parameters.
+ * A new order takes effect the next time a device is trimmed.
+ */
+module_param(scullpg_order, int, S_IRUGO | S_IWUSR);
+module_param(scullpg_min_order, int, S_IRUGO | S_IWUSR);
+module_param(scullpg_dma32, int, S_IRUGO | S_IWUSR);
 MODULE_AUTHOR("Alessandro Rubini");
 MODULE_LICENSE("Dual BSD/GPL");
+MODULE_IMPORT_NS(DMA_BUF);
 
 struct scullpg_dev *scullpg_devices; /* allocated in scullpg_init */
+struct scullpg_order_stats scullpg_stats[MAX_ORDER];
 
 int scullpg_trim(struct scullpg_dev *dev);
 void scullpg_cleanup(void);
@@ -79,9 +99,13 @@ static int scullpg_seq_show(struct seq_file *s, void *v)
 			if (d->data &&
 			    !d->next) /* dump only the last item - save space */
 				for (j = 0; j < qset; j++) {
-					if (d->data[j])
-						seq_printf(s, "    % 4i:%8p\n",
-							   j, d->data[j]);
+					struct scullpg_quantum *q = d->data[j];
+
+					if (q)
+						seq_printf(s,
+							   "    % 4i:%8p order %i\n",
+							   j, q->chunk[0],
+							   q->order);
 				}
 		}
 		up(&scullpg_devices[i].sem);
@@ -127,6 +151,122 @@ static void scullpg_remove_proc(void)
 
 #endif /* SCULLPG_USE_PROC */
 
+/*
+ * The allocation statistics are always available: they are what one
+ * looks at to pick scullpg_order, debugging or not.
+ */
+static int scullpg_alloc_show(struct seq_file *s, void *v)
+{
+	int order, b;
+
+	seq_printf(s, "order %i, min_order %i\n", scullpg_order,
+		   scullpg_min_order);
+	seq_printf(s, "order  attempts  failures  achieved  latency(us):");
+	seq_printf(s, "  <1");
+	for (b = 1; b < SCULLPG_LAT_BUCKETS; b++)
+		seq_printf(s, " %5u", 1U << (b - 1));
+	seq_putc(s, '\n');
+
+	for (order = 0; order < MAX_ORDER; order++) {
+		struct scullpg_order_stats *st = &scullpg_stats[order];
+
+		if (!atomic_long_read(&st->attempts))
+			continue;
+		seq_printf(s, "%5i %9li %9li %9li              ", order,
+			   atomic_long_read(&st->attempts),
+			   atomic_long_read(&st->failures),
+			   atomic_long_read(&st->achieved));
+		seq_printf(s, "%4li", atomic_long_read(&st->lat[0]));
+		for (b = 1; b < SCULLPG_LAT_BUCKETS; b++)
+			seq_printf(s, " %5li", atomic_long_read(&st->lat[b]));
+		seq_putc(s, '\n');
+	}
+	return 0;
+}
+
+static int scullpg_alloc_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, scullpg_alloc_show, NULL);
+}
+
+static const struct proc_ops scullpg_alloc_proc_ops = {
+	.proc_open = scullpg_alloc_open,
+	.proc_read = seq_read,
+	.proc_lseek = seq_lseek,
+	.proc_release = single_release,
+};
+
+/*
+ * Quantum allocation. Each order is tried with __GFP_NORETRY so the page
+ * allocator gives up after a single, light compaction pass instead of
+ * stalling; only the last resort (the minimum order) may reclaim hard.
+ */
+static void *scullpg_get_chunk(int order, bool last)
+{
+	struct scullpg_order_stats *st = &scullpg_stats[order];
+	gfp_t gfp = GFP_KERNEL | __GFP_ZERO;
+	unsigned long usecs;
+	void *chunk;
+	u64 t0;
+	int b;
+
+	if (!last)
+		gfp |= __GFP_NORETRY | __GFP_NOWARN;
+	if (scullpg_dma32)
+		gfp |= GFP_DMA32;
+
+	t0 = ktime_get_ns();
+	chunk = (void *)__get_free_pages(gfp, order);
+	usecs = (unsigned long)div_u64(ktime_get_ns() - t0, NSEC_PER_USEC);
+
+	b = usecs ? min(ilog2(usecs) + 1, SCULLPG_LAT_BUCKETS - 1) : 0;
+	atomic_long_inc(&st->lat[b]);
+	atomic_long_inc(&st->attempts);
+	if (!chunk)
+		atomic_long_inc(&st->failures);
+	return chunk;
+}
+
+static void scullpg_free_quantum(struct scullpg_quantum *q)
+{
+	int i;
+
+	for (i = 0; i < q->nchunks; i++)
+		if (q->chunk[i])
+			free_pages((unsigned long)q->chunk[i], q->order);
+	kfree(q);
+}
+
+static struct scullpg_quantum *scullpg_alloc_quantum(int order)
+{
+	int min_order = clamp(scullpg_min_order, 0, order);
+	struct scullpg_quantum *q;
+	int try, i;
+
+	for (try = order; try >= min_order; try--) {
+		int nchunks = 1 << (order - try);
+
+		q = kzalloc(struct_size(q, chunk, nchunks), GFP_KERNEL);
+		if (!q)
+			return NULL;
+		q->order = try;
+		q->nchunks = nchunks;
+
+		for (i = 0; i < nchunks; i++) {
+			q->chunk[i] = scullpg_get_chunk(try, try == min_order);
+			if (!q->chunk[i])
+				break;
+		}
+		if (i == nchunks) {
+			atomic_long_inc(&scullpg_stats[try].achieved);
+			return q;
+		}
+		/* fall back to the next smaller order */
+		scullpg_free_quantum(q);
+	}
+	return NULL;
+}
+
 int scullpg_open(struct inode *inode, struct file *filp)
 {
 	struct scullpg_dev *dev; /* device information */
@@ -176,10 +316,11 @@ ssize_t scullpg_read(struct file *filp, char __user *buf, size_t count,
 {
 	struct scullpg_dev *dev = filp->private_data; /* the first listitem */
 	struct scullpg_dev *dptr;
+	struct scullpg_quantum *q;
 	int quantum = PAGE_SIZE << dev->order;
 	int qset = dev->qset;
 	int itemsize = quantum * qset; /* how many bytes in the listitem */
-	int item, s_pos, q_pos, rest;
+	int item, s_pos, q_pos, rest, chunksize, c_pos;
 	ssize_t retval = 0;
 
 	if (down_interruptible(&dev->sem))
@@ -195,17 +336,22 @@ ssize_t scullpg_read(struct file *filp, char __user *buf, size_t count,
 	q_pos = rest % quantum;
 
 	/* follow the list up to the right position (defined elsewhere) */
+	down_write(&dev->qlock); /* scullpg_follow() may extend the list */
 	dptr = scullpg_follow(dev, item);
+	up_write(&dev->qlock);
 
 	if (!dptr->data)
 		goto nothing; /* don't fill holes */
-	if (!dptr->data[s_pos])
+	q = dptr->data[s_pos];
+	if (!q)
 		goto nothing;
-	if (count > quantum - q_pos)
-		count = quantum -
-			q_pos; /* read only up to the end of this quantum */
+	chunksize = PAGE_SIZE << q->order;
+	c_pos = q_pos % chunksize;
+	if (count > chunksize - c_pos)
+		count = chunksize -
+			c_pos; /* read only up to the end of this chunk */
 
-	if (copy_to_user(buf, dptr->data[s_pos] + q_pos, count)) {
+	if (copy_to_user(buf, q->chunk[q_pos / chunksize] + c_pos, count)) {
 		retval = -EFAULT;
 		goto nothing;
 	}
@@ -224,10 +370,11 @@ ssize_t scullpg_write(struct file *filp, const char __user *buf, size_t count,
 {
 	struct scullpg_dev *dev = filp->private_data;
 	struct scullpg_dev *dptr;
+	struct scullpg_quantum *q;
 	int quantum = PAGE_SIZE << dev->order;
 	int qset = dev->qset;
 	int itemsize = quantum * qset;
-	int item, s_pos, q_pos, rest;
+	int item, s_pos, q_pos, rest, chunksize, c_pos;
 	ssize_t retval = -ENOMEM; /* our most likely error */
 
 	if (down_interruptible(&dev->sem))
@@ -240,36 +387,43 @@ ssize_t scullpg_write(struct file *filp, const char __user *buf, size_t count,
 	q_pos = rest % quantum;
 
 	/* follow the list up to the right position */
+	down_write(&dev->qlock);
 	dptr = scullpg_follow(dev, item);
 	if (!dptr->data) {
 		dptr->data = kmalloc(qset * sizeof(void *), GFP_KERNEL);
 		if (!dptr->data)
-			goto nomem;
+			goto nomem_unlock;
 		memset(dptr->data, 0, qset * sizeof(char *));
 	}
-	/* Allocate a quantum using who pages. */
+	/* Allocate a quantum using whole pages, falling back if need be. */
 	if (!dptr->data[s_pos]) {
-		dptr->data[s_pos] =
-			(void *)__get_free_pages(GFP_KERNEL, dptr->order);
+		dptr->data[s_pos] = scullpg_alloc_quantum(dev->order);
 		if (!dptr->data[s_pos])
-			goto nomem;
-		memset(dptr->data[s_pos], 0, PAGE_SIZE << scullpg_order);
+			goto nomem_unlock;
 	}
-	if (count > quantum - q_pos)
-		count = quantum -
-			q_pos; /* write only up to the end of this quantum */
-	if (copy_from_user(dptr->data[s_pos] + q_pos, buf, count)) {
+	up_write(&dev->qlock); /* the copy below may fault on our mapping */
+	q = dptr->data[s_pos];
+	chunksize = PAGE_SIZE << q->order;
+	c_pos = q_pos % chunksize;
+	if (count > chunksize - c_pos)
+		count = chunksize -
+			c_pos; /* write only up to the end of this chunk */
+	if (copy_from_user(q->chunk[q_pos / chunksize] + c_pos, buf, count)) {
 		retval = -EFAULT;
 		goto nomem;
 	}
 	*f_pos += count;
 
 	/* update the size */
+	down_write(&dev->qlock);
 	if (dev->size < *f_pos)
 		dev->size = *f_pos;
+	up_write(&dev->qlock);
 	up(&dev->sem);
 	return count;
 
+nomem_unlock:
+	up_write(&dev->qlock);
 nomem:
 	up(&dev->sem);
 	return retval;
@@ -305,11 +459,392 @@ loff_t scullpg_llseek(struct file *filp, loff_t off, int whence)
 	return newpos;
 }
 
+/*
+ * The mmap implementation. Quanta are physically contiguous, so they are
+ * mapped straight into user space as raw PFNs, one page per fault, or one
+ * PMD at a time when a chunk is at least a huge page in size. The device
+ * can't be trimmed while mapped, so the pages can't go away under us.
+ */
+static void scullpg_vma_open(struct vm_area_struct *vma)
+{
+	struct scullpg_dev *dev = vma->vm_private_data;
+
+	atomic_inc(&dev->vmas);
+}
+
+static void scullpg_vma_close(struct vm_area_struct *vma)
+{
+	struct scullpg_dev *dev = vma->vm_private_data;
+
+	atomic_dec(&dev->vmas);
+}
+
+/*
+ * Find the kernel address backing device page "pgoff", without allocating
+ * anything. Returns NULL for holes, otherwise stores the order of the
+ * chunk holding the page in "order". Called with qlock held.
+ */
+static void *scullpg_find_page(struct scullpg_dev *dev, pgoff_t pgoff,
+			       int *order)
+{
+	struct scullpg_dev *dptr = dev;
+	struct scullpg_quantum *q;
+	unsigned long qpages = 1UL << dev->order; /* pages in a quantum */
+	unsigned long itempages = qpages * dev->qset;
+	unsigned long item = pgoff / itempages;
+	unsigned long rest = pgoff % itempages;
+	unsigned long q_pg = rest % qpages;
+
+	while (dptr && item--)
+		dptr = dptr->next;
+	if (!dptr || !dptr->data)
+		return NULL;
+	q = dptr->data[rest / qpages];
+	if (!q)
+		return NULL;
+
+	*order = q->order;
+	return q->chunk[q_pg >> q->order] +
+	       ((q_pg & ((1UL << q->order) - 1)) << PAGE_SHIFT);
+}
+
+static vm_fault_t scullpg_vma_fault(struct vm_fault *vmf)
+{
+	struct scullpg_dev *dev = vmf->vma->vm_private_data;
+	vm_fault_t retval = VM_FAULT_SIGBUS;
+	void *addr;
+	int order;
+
+	down_read(&dev->qlock); /* not sem: see struct scullpg_dev */
+	if ((loff_t)vmf->pgoff << PAGE_SHIFT >= dev->size)
+		goto out; /* out of range */
+	addr = scullpg_find_page(dev, vmf->pgoff, &order);
+	if (!addr)
+		goto out; /* hole */
+	retval = vmf_insert_pfn(vmf->vma, vmf->address,
+				page_to_pfn(virt_to_page(addr)));
+out:
+	up_read(&dev->qlock);
+	return retval;
+}
+
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+static vm_fault_t scullpg_vma_huge_fault(struct vm_fault *vmf,
+					 enum page_entry_size pe_size)
+{
+	struct vm_area_struct *vma = vmf->vma;
+	struct scullpg_dev *dev = vma->vm_private_data;
+	unsigned long haddr = vmf->address & PMD_MASK;
+	vm_fault_t retval = VM_FAULT_FALLBACK;
+	pgoff_t pgoff;
+	void *addr;
+	int order;
+
+	if (pe_size != PE_SIZE_PMD)
+		return VM_FAULT_FALLBACK;
+	if (haddr < vma->vm_start || haddr + PMD_SIZE > vma->vm_end)
+		return VM_FAULT_FALLBACK;
+	pgoff = vma->vm_pgoff + ((haddr - vma->vm_start) >> PAGE_SHIFT);
+	if (pgoff & (HPAGE_PMD_NR - 1))
+		return VM_FAULT_FALLBACK; /* file offset not huge aligned */
+
+	down_read(&dev->qlock);
+	if ((loff_t)(pgoff + HPAGE_PMD_NR) << PAGE_SHIFT > dev->size)
+		goto out; /* the tail end is mapped a page at a time */
+	addr = scullpg_find_page(dev, pgoff, &order);
+	if (!addr || order < HPAGE_PMD_ORDER)
+		goto out; /* hole, or the quantum fell back to small chunks */
+	retval = vmf_insert_pfn_pmd(
+		vmf, pfn_to_pfn_t(page_to_pfn(virt_to_page(addr))),
+		vmf->flags & FAULT_FLAG_WRITE);
+out:
+	up_read(&dev->qlock);
+	return retval;
+}
+#endif
+
+static const struct vm_operations_struct scullpg_vm_ops = {
+	.open = scullpg_vma_open,
+	.close = scullpg_vma_close,
+	.fault = scullpg_vma_fault,
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+	.huge_fault = scullpg_vma_huge_fault,
+#endif
+};
+
+int scullpg_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct scullpg_dev *dev = filp->private_data;
+
+	/* raw PFN mappings can't be copy-on-write */
+	if (is_cow_mapping(vma->vm_flags))
+		return -EINVAL;
+
+	vma->vm_ops = &scullpg_vm_ops;
+	vma->vm_flags |= VM_PFNMAP | VM_DONTEXPAND | VM_DONTDUMP;
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+	/* madvise(MADV_HUGEPAGE) ignores PFN mappings: opt in ourselves */
+	vma->vm_flags |= VM_HUGEPAGE;
+#endif
+	vma->vm_private_data = dev;
+	scullpg_vma_open(vma);
+	return 0;
+}
+
+/*
+ * dma-buf export. An exported buffer is described by the array of pages
+ * backing a range of quanta; like a mapping, it pins the device contents
+ * until it is released.
+ */
+struct scullpg_dmabuf {
+	struct scullpg_dev *dev;
+	struct page **pages;
+	unsigned long npages;
+};
+
+static struct sg_table *scullpg_map_dma_buf(struct dma_buf_attachment *at,
+					    enum dma_data_direction dir)
+{
+	struct scullpg_dmabuf *sbuf = at->dmabuf->priv;
+	struct sg_table *sgt;
+	int err;
+
+	sgt = kzalloc(sizeof(*sgt), GFP_KERNEL);
+	if (!sgt)
+		return ERR_PTR(-ENOMEM);
+	/* contiguous pages of a chunk are merged into a single entry */
+	err = sg_alloc_table_from_pages(sgt, sbuf->pages, sbuf->npages, 0,
+					sbuf->npages << PAGE_SHIFT, GFP_KERNEL);
+	if (err)
+		goto fail_alloc;
+	err = dma_map_sgtable(at->dev, sgt, dir, 0);
+	if (err)
+		goto fail_map;
+	return sgt;
+
+fail_map:
+	sg_free_table(sgt);
+fail_alloc:
+	kfree(sgt);
+	return ERR_PTR(err);
+}
+
+static void scullpg_unmap_dma_buf(struct dma_buf_attachment *at,
+				  struct sg_table *sgt,
+				  enum dma_data_direction dir)
+{
+	dma_unmap_sgtable(at->dev, sgt, dir, 0);
+	sg_free_table(sgt);
+	kfree(sgt);
+}
+
+static void scullpg_release_dma_buf(struct dma_buf *buf)
+{
+	struct scullpg_dmabuf *sbuf = buf->priv;
+
+	atomic_dec(&sbuf->dev->exports);
+	kvfree(sbuf->pages);
+	kfree(sbuf);
+}
+
+static int scullpg_vmap_dma_buf(struct dma_buf *buf, struct iosys_map *map)
+{
+	struct scullpg_dmabuf *sbuf = buf->priv;
+	void *vaddr;
+
+	vaddr = vm_map_ram(sbuf->pages, sbuf->npages, NUMA_NO_NODE);
+	if (!vaddr)
+		return -ENOMEM;
+	iosys_map_set_vaddr(map, vaddr);
+	return 0;
+}
+
+static void scullpg_vunmap_dma_buf(struct dma_buf *buf, struct iosys_map *map)
+{
+	struct scullpg_dmabuf *sbuf = buf->priv;
+
+	vm_unmap_ram(map->vaddr, sbuf->npages);
+}
+
+static int scullpg_mmap_dma_buf(struct dma_buf *buf, struct vm_area_struct *vma)
+{
+	struct scullpg_dmabuf *sbuf = buf->priv;
+	unsigned long addr = vma->vm_start;
+	unsigned long i, run;
+	int err;
+
+	if (vma->vm_pgoff + vma_pages(vma) > sbuf->npages)
+		return -EINVAL;
+	/*
+	 * A private mapping needs one remap_pfn_range() of the whole of it,
+	 * and our pages are contiguous only a chunk at a time. Tail pages of
+	 * a chunk aren't refcounted, so vm_insert_page() is no way out.
+	 */
+	if (!(vma->vm_flags & VM_SHARED))
+		return -EINVAL;
+
+	/* remap runs of physically contiguous pages in one go */
+	for (i = vma->vm_pgoff; addr < vma->vm_end; i += run) {
+		unsigned long pfn = page_to_pfn(sbuf->pages[i]);
+
+		for (run = 1; addr + (run << PAGE_SHIFT) < vma->vm_end; run++)
+			if (page_to_pfn(sbuf->pages[i + run]) != pfn + run)
+				break;
+		err = remap_pfn_range(vma, addr, pfn, run << PAGE_SHIFT,
+				      vma->vm_page_prot);
+		if (err)
+			return err;
+		addr += run << PAGE_SHIFT;
+	}
+	return 0;
+}
+
+static const struct dma_buf_ops scullpg_dma_buf_ops = {
+	.map_dma_buf = scullpg_map_dma_buf,
+	.unmap_dma_buf = scullpg_unmap_dma_buf,
+	.release = scullpg_release_dma_buf,
+	.vmap = scullpg_vmap_dma_buf,
+	.vunmap = scullpg_vunmap_dma_buf,
+	.mmap = scullpg_mmap_dma_buf,
+};
+
+static struct dma_buf *scullpg_do_export(struct scullpg_dev *dev,
+					 unsigned int first, unsigned int count)
+{
+	DEFINE_DMA_BUF_EXPORT_INFO(exp_info);
+	struct scullpg_dmabuf *sbuf;
+	struct scullpg_dev *dptr = dev;
+	struct scullpg_quantum *q;
+	struct dma_buf *buf;
+	size_t quantum = PAGE_SIZE << dev->order;
+	unsigned long n = 0, nq;
+	unsigned int i, j, k;
+	int err = -ENOMEM;
+
+	nq = DIV_ROUND_UP(dev->size, quantum);
+	if (!count && first < nq)
+		count = nq - first;
+	if (!count || first >= nq || count > nq - first)
+		return ERR_PTR(-EINVAL);
+
+	sbuf = kzalloc(sizeof(*sbuf), GFP_KERNEL);
+	if (!sbuf)
+		return ERR_PTR(-ENOMEM);
+	sbuf->dev = dev;
+	sbuf->npages = (unsigned long)count << dev->order;
+	sbuf->pages = kvmalloc_array(sbuf->npages, sizeof(struct page *),
+				     GFP_KERNEL);
+	if (!sbuf->pages)
+		goto fail;
+
+	/* collect the pages of every quantum in the range */
+	for (i = first / dev->qset; dptr && i; i--)
+		dptr = dptr->next;
+	for (i = first; i < first + count; i++) {
+		if (i != first && i % dev->qset == 0 && dptr)
+			dptr = dptr->next; /* on to the next listitem */
+		q = (dptr && dptr->data) ? dptr->data[i % dev->qset] : NULL;
+		if (!q) {
+			err = -ENXIO; /* can't export holes */
+			goto fail;
+		}
+		for (j = 0; j < q->nchunks; j++)
+			for (k = 0; k < (1U << q->order); k++)
+				sbuf->pages[n++] = virt_to_page(q->chunk[j]) + k;
+	}
+
+	exp_info.ops = &scullpg_dma_buf_ops;
+	exp_info.size = sbuf->npages << PAGE_SHIFT;
+	exp_info.flags = O_RDWR;
+	exp_info.priv = sbuf;
+	buf = dma_buf_export(&exp_info);
+	if (IS_ERR(buf)) {
+		err = PTR_ERR(buf);
+		goto fail;
+	}
+	atomic_inc(&dev->exports);
+	return buf;
+
+fail:
+	kvfree(sbuf->pages);
+	kfree(sbuf);
+	return ERR_PTR(err);
+}
+
+/*
+ * Export a range of quanta of device "index" to another kernel module.
+ * The caller owns the reference and drops it with dma_buf_put().
+ */
+struct dma_buf *scullpg_export_dmabuf(int index, unsigned int first,
+				      unsigned int count)
+{
+	struct scullpg_dev *dev;
+	struct dma_buf *buf;
+
+	if (index < 0 || index >= scullpg_devs)
+		return ERR_PTR(-ENODEV);
+	dev = scullpg_devices + index;
+
+	if (down_interruptible(&dev->sem))
+		return ERR_PTR(-ERESTARTSYS);
+	buf = scullpg_do_export(dev, first, count);
+	up(&dev->sem);
+	return buf;
+}
+EXPORT_SYMBOL(scullpg_export_dmabuf);
+
+long scullpg_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct scullpg_dev *dev = filp->private_data;
+	struct scullpg_export exp;
+	struct dma_buf *buf;
+
+	/* don't even decode wrong cmds: better returning  ENOTTY than EFAULT */
+	if (_IOC_TYPE(cmd) != SCULLPG_IOC_MAGIC)
+		return -ENOTTY;
+	if (_IOC_NR(cmd) > SCULLPG_IOC_MAXNR)
+		return -ENOTTY;
+
+	switch (cmd) {
+	case SCULLPG_IOCEXPORT:
+		if (copy_from_user(&exp, (void __user *)arg, sizeof(exp)))
+			return -EFAULT;
+		if (exp.flags & ~O_CLOEXEC)
+			return -EINVAL;
+
+		if (down_interruptible(&dev->sem))
+			return -ERESTARTSYS;
+		buf = scullpg_do_export(dev, exp.first, exp.count);
+		up(&dev->sem);
+		if (IS_ERR(buf))
+			return PTR_ERR(buf);
+
+		exp.fd = dma_buf_fd(buf, exp.flags);
+		if (exp.fd < 0) {
+			int err = exp.fd;
+
+			dma_buf_put(buf);
+			return err;
+		}
+		/* the fd is live already: on failure user space may leak it */
+		if (copy_to_user((void __user *)arg, &exp, sizeof(exp)))
+			return -EFAULT;
+		return 0;
+
+	default: /* redundant, as cmd was checked against MAXNR */
+		return -ENOTTY;
+	}
+}
+
 struct file_operations scullpg_fops = {
 	.owner = THIS_MODULE,
 	.llseek = scullpg_llseek,
 	.read = scullpg_read,
 	.write = scullpg_write,
+	.unlocked_ioctl = scullpg_ioctl,
+	.mmap = scullpg_mmap,
+	/* align mappings to PMD boundaries so huge faults can be served */
+	.get_unmapped_area = thp_get_unmapped_area,
 	.open = scullpg_open,
 	.release = scullpg_release,
 };
@@ -320,12 +855,16 @@ int scullpg_trim(struct scullpg_dev *dev)
 	int qset = dev->qset; /* "dev" is not-null */
 	int i;
 
+	/* don't trim: there are active mappings or exported buffers */
+	if (atomic_read(&dev->vmas) || atomic_read(&dev->exports))
+		return -EBUSY;
+
+	down_write(&dev->qlock);
 	for (dptr = dev; dptr; dptr = next) { /* all the list items */
 		if (dptr->data) {
 			for (i = 0; i < qset; i++)
 				if (dptr->data[i])
-					free_pages((unsigned long)dptr->data[i],
-						   dptr->order);
+					scullpg_free_quantum(dptr->data[i]);
 
 			kfree(dptr->data);
 			dptr->data = NULL;
@@ -336,8 +875,9 @@ int scullpg_trim(struct scullpg_dev *dev)
 	}
 	dev->size = 0;
 	dev->qset = scullpg_qset;
-	dev->order = scullpg_order;
+	dev->order = clamp(scullpg_order, 0, MAX_ORDER - 1);
 	dev->next = NULL;
+	up_write(&dev->qlock);
 	return 0;
 }
 
@@ -382,16 +922,19 @@ int scullpg_init(void)
 		goto fail_malloc;
 	}
 	memset(scullpg_devices, 0, scullpg_devs * sizeof(struct scullpg_dev));
+	scullpg_order = clamp(scullpg_order, 0, MAX_ORDER - 1);
 	for (i = 0; i < scullpg_devs; i++) {
 		scullpg_devices[i].qset = scullpg_qset;
 		scullpg_devices[i].order = scullpg_order;
 		sema_init(&scullpg_devices[i].sem, 1);
+		init_rwsem(&scullpg_devices[i].qlock);
 		scullpg_setup_cdev(scullpg_devices + i, i);
 	}
 
 #ifdef SCULLPG_USE_PROC /* only when available */
 	scullpg_create_proc();
 #endif
+	proc_create("scullpgalloc", 0, NULL, &scullpg_alloc_proc_ops);
 	return 0; /* succeed */
 
 fail_malloc:
@@ -404,6 +947,7 @@ void scullpg_cleanup(void)
 #ifdef SCULLPG_USE_PROC
 	scullpg_remove_proc();
 #endif
+	remove_proc_entry("scullpgalloc", NULL);
 
 	for (int i = 0; i < scullpg_devs; i++) {
 		cdev_del(&scullpg_devices[i].cdev);
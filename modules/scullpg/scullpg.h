@@ -7,9 +7,13 @@
 #ifndef _SCULLPG_H_
 #define _SCULLPG_H_
 
+#include <linux/atomic.h>
 #include <linux/cdev.h>
 #include <linux/ioctl.h>
+#include <linux/mmzone.h> /* MAX_ORDER */
+#include <linux/rwsem.h>
 #include <linux/semaphore.h>
+#include <linux/types.h>
 
 /*
  * Macros to help debugging
@@ -38,20 +42,45 @@
  * Use a linked list of indirect blocks.
  *
  * "scullpg_dev->data" points to an array of pointers, each
- * pointer refers to a memory page.
+ * pointer refers to a quantum.
  *
  * The array (quantum-set) is SCULLPG_QSET long.
  */
 #define SCULLPG_ORDER 0 /* one page at a time */
+#define SCULLPG_MIN_ORDER 0 /* smallest order we fall back to */
 #define SCULLPG_QSET 500
 
+/*
+ * A quantum is PAGE_SIZE << order bytes. We first ask for a single block
+ * of that order, but without retrying hard: on a fragmented system that
+ * would stall in direct compaction. If it fails, the quantum is assembled
+ * from several smaller blocks ("chunks") instead. "order" is the order
+ * that was actually achieved, so a quantum holds 1 << (dev order - order)
+ * chunks.
+ */
+struct scullpg_quantum {
+	int order; /* achieved order of every chunk */
+	int nchunks; /* number of entries in chunk[] */
+	void *chunk[];
+};
+
 struct scullpg_dev {
 	void **data;
 	struct scullpg_dev *next; /* next listitem */
 	int qset; /* the current array size */
 	int order;
 	size_t size; /* 32-bit will suffice */
+	atomic_t vmas; /* active mappings */
+	atomic_t exports; /* live dma-bufs exported from this device */
 	struct semaphore sem; /* Mutual exclusion */
+	/*
+	 * The list, the quanta and "size", as the fault handlers see them.
+	 * read() and write() copy to and from user space under "sem", maybe
+	 * from a mapping of this very device, so the faults can't take it;
+	 * whoever changes these takes both, but never keeps qlock across a
+	 * user copy.
+	 */
+	struct rw_semaphore qlock;
 	struct cdev cdev;
 };
 
@@ -65,16 +94,59 @@ extern struct file_operations scullpg_fops;
 extern int scullpg_major; /* main.c */
 extern int scullpg_devs;
 extern int scullpg_order;
+extern int scullpg_min_order;
 extern int scullpg_qset;
+extern int scullpg_dma32;
+
+/*
+ * Allocation statistics, one entry per order attempted. Latencies are
+ * kept in a log2 histogram of microseconds: bucket 0 counts calls that
+ * took less than 1us, bucket n those that took [2^(n-1), 2^n) us.
+ */
+#define SCULLPG_LAT_BUCKETS 16
+
+struct scullpg_order_stats {
+	atomic_long_t attempts; /* __get_free_pages() calls at this order */
+	atomic_long_t failures; /* ... and how many of them failed */
+	atomic_long_t achieved; /* quanta that ended up at this order */
+	atomic_long_t lat[SCULLPG_LAT_BUCKETS];
+};
+
+extern struct scullpg_order_stats scullpg_stats[MAX_ORDER];
 
 /*
  * Prototypes for shared functions
  */
 int scullpg_trim(struct scullpg_dev *dev);
 struct scullpg_dev *scullpg_follow(struct scullpg_dev *dev, int n);
+struct dma_buf *scullpg_export_dmabuf(int index, unsigned int first,
+				      unsigned int count);
 
 #ifdef SCULLPG_DEBUG
 #define SCULLPG_USE_PROC
 #endif
 
+/*
+ * Ioctl definitions
+ */
+
+/* Use '0xDF' as magic number */
+#define SCULLPG_IOC_MAGIC 0xDF
+
+/*
+ * Export "count" quanta, starting at quantum "first", as a dma-buf. A
+ * count of zero exports everything up to the end of the device. The new
+ * file descriptor is returned in "fd"; "flags" may hold O_CLOEXEC.
+ */
+struct scullpg_export {
+	__u32 first;
+	__u32 count;
+	__u32 flags;
+	__s32 fd;
+};
+
+#define SCULLPG_IOCEXPORT _IOWR(SCULLPG_IOC_MAGIC, 1, struct scullpg_export)
+
+#define SCULLPG_IOC_MAXNR 1
+
 #endif
@@ -0,0 +1,134 @@
+/*
+ * scullpg_import.c - Loopback dma-buf importer for scullpg self-tests.
+ *
+ * Imports a range of scullpg quanta as a dma-buf and checksums it twice:
+ * once through the kernel mapping returned by dma_buf_vmap(), once by
+ * walking the pages of the scatterlist returned by dma_buf_map_attachment().
+ * Both must agree. Load it after writing some data to the device, e.g.
+ *
+ *     dd if=/dev/urandom of=/dev/scullpg0 bs=4096 count=64
+ *     insmod ./scullpg_import.ko dev=0 first=0 count=0
+ *
+ * The checksums are printed to the kernel log. Like kdatasize, the module
+ * refuses to stay loaded: it fails with -ENODEV on success and -EIO when
+ * the checksums differ.
+ */
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/init.h>
+#include <linux/kernel.h> /* printk() */
+#include <linux/crc32.h>
+#include <linux/device.h>
+#include <linux/dma-buf.h>
+#include <linux/dma-mapping.h>
+#include <linux/highmem.h>
+#include <linux/iosys-map.h>
+#include <linux/scatterlist.h>
+
+#include "scullpg.h"
+
+static int dev = 0; /* scullpg minor to import from */
+static unsigned int first = 0; /* first quantum */
+static unsigned int count = 0; /* number of quanta, 0 means all */
+
+module_param(dev, int, 0);
+module_param(first, uint, 0);
+module_param(count, uint, 0);
+MODULE_LICENSE("Dual BSD/GPL");
+MODULE_IMPORT_NS(DMA_BUF);
+
+static int import_vmap_crc(struct dma_buf *buf, u32 *crc)
+{
+	struct iosys_map map;
+	int err;
+
+	err = dma_buf_vmap(buf, &map);
+	if (err)
+		return err;
+	*crc = crc32_le(~0, map.vaddr, buf->size) ^ ~0;
+	dma_buf_vunmap(buf, &map);
+	return 0;
+}
+
+static int import_sg_crc(struct dma_buf *buf, struct device *importer,
+			 u32 *crc, unsigned int *nents)
+{
+	struct dma_buf_attachment *at;
+	struct sg_table *sgt;
+	struct sg_page_iter iter;
+	u32 c = ~0;
+
+	at = dma_buf_attach(buf, importer);
+	if (IS_ERR(at))
+		return PTR_ERR(at);
+	sgt = dma_buf_map_attachment(at, DMA_BIDIRECTIONAL);
+	if (IS_ERR(sgt)) {
+		dma_buf_detach(buf, at);
+		return PTR_ERR(sgt);
+	}
+
+	/* a real device would DMA here; we look at the pages instead */
+	for_each_sgtable_page(sgt, &iter, 0) {
+		void *vaddr = kmap_local_page(sg_page_iter_page(&iter));
+
+		c = crc32_le(c, vaddr, PAGE_SIZE);
+		kunmap_local(vaddr);
+	}
+	*crc = c ^ ~0;
+	*nents = sgt->nents;
+
+	dma_buf_unmap_attachment(at, sgt, DMA_BIDIRECTIONAL);
+	dma_buf_detach(buf, at);
+	return 0;
+}
+
+static int __init import_init(void)
+{
+	struct device *importer;
+	struct dma_buf *buf;
+	u32 vmap_crc, sg_crc;
+	unsigned int nents;
+	int err;
+
+	/* a device to attach with, capable of addressing all of memory */
+	importer = root_device_register("scullpg_import");
+	if (IS_ERR(importer))
+		return PTR_ERR(importer);
+	err = dma_coerce_mask_and_coherent(importer, DMA_BIT_MASK(64));
+	if (err)
+		goto out_dev;
+
+	buf = scullpg_export_dmabuf(dev, first, count);
+	if (IS_ERR(buf)) {
+		err = PTR_ERR(buf);
+		printk(KERN_INFO "scullpg_import: export failed: %i\n", err);
+		goto out_dev;
+	}
+
+	err = import_vmap_crc(buf, &vmap_crc);
+	if (err)
+		goto out_buf;
+	err = import_sg_crc(buf, importer, &sg_crc, &nents);
+	if (err)
+		goto out_buf;
+
+	printk(KERN_INFO "scullpg_import: scullpg%i quanta %u+%u: %zu bytes, "
+			 "%u sg entries, crc32 vmap %08x sg %08x: %s\n",
+	       dev, first, count, buf->size, nents, vmap_crc, sg_crc,
+	       vmap_crc == sg_crc ? "ok" : "MISMATCH");
+	err = vmap_crc == sg_crc ? -ENODEV : -EIO;
+
+out_buf:
+	dma_buf_put(buf);
+out_dev:
+	root_device_unregister(importer);
+	return err;
+}
+
+static void __exit import_cleanup(void)
+{
+	/* never called */
+}
+
+module_init(import_init);
+module_exit(import_cleanup);
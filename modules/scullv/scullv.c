@@ -16,6 +16,8 @@
 #include <linux/proc_fs.h>
 #include <linux/seq_file.h>
 #include <linux/fcntl.h> /* O_ACCMODE */
+#include <linux/ktime.h>
+#include <linux/workqueue.h>
 #include <asm/uaccess.h>
 
 #include "scullv.h" /* local definitions */
@@ -24,11 +26,19 @@ int scullv_major = SCULLV_MAJOR;
 int scullv_devs = SCULLV_DEVS; /* number of bare scullv devices */
 int scullv_qset = SCULLV_QSET;
 int scullv_order = SCULLV_ORDER;
+int scullv_flat = 0; /* one flat area per device instead of a quantum list */
+unsigned long scullv_area = SCULLV_AREA; /* flat mode: max device size */
 
 module_param(scullv_major, int, 0);
 module_param(scullv_devs, int, 0);
 module_param(scullv_qset, int, 0);
 module_param(scullv_order, int, 0);
+module_param(scullv_flat, int, 0);
+module_param(scullv_area, ulong, 0);
+
+/* quanta freed between two reschedule points when trimming */
+static int scullv_trim_batch = 64;
+module_param(scullv_trim_batch, int, S_IRUGO | S_IWUSR);
 MODULE_AUTHOR("Alessandro Rubini");
 MODULE_LICENSE("Dual BSD/GPL");
 
@@ -75,6 +85,9 @@ static int scullv_seq_show(struct seq_file *s, void *v)
 		quantum = PAGE_SIZE << d->order;
 		seq_printf(s, "\nDevice %i: qset %i, order %i, sz %li\n", i,
 			   qset, d->order, (long)(d->size));
+		if (scullv_flat)
+			seq_printf(s, "  area at %p, %lu pages\n", d->area,
+				   d->npages);
 		for (; d; d = d->next) { /* scan the list */
 			seq_printf(s, "  item at %p, qset at %p\n", d, d->data);
 			if (d->data &&
@@ -168,6 +181,89 @@ struct scullv_dev *scullv_follow(struct scullv_dev *dev, int n)
 	return dev;
 }
 
+/*
+ * Flat mode. Make sure the area covers "size" bytes, remapping it when it
+ * has to grow. Growing geometrically keeps the number of vmap()/vunmap()
+ * pairs (and of TLB flushes) logarithmic in the device size.
+ */
+static int scullv_flat_grow(struct scullv_dev *dev, size_t size)
+{
+	unsigned long need = PAGE_ALIGN(size) >> PAGE_SHIFT;
+	unsigned long n, i;
+	struct page **pages;
+	void *area;
+
+	if (need <= dev->npages)
+		return 0;
+
+	n = max3(need, dev->npages * 2, 1UL << dev->order);
+	n = min(n, PAGE_ALIGN(scullv_area) >> PAGE_SHIFT);
+	pages = kvmalloc_array(n, sizeof(*pages), GFP_KERNEL);
+	if (!pages)
+		return -ENOMEM;
+	if (dev->npages)
+		memcpy(pages, dev->pages, dev->npages * sizeof(*pages));
+
+	for (i = dev->npages; i < n; i++) {
+		pages[i] = alloc_page(GFP_KERNEL | __GFP_HIGHMEM | __GFP_ZERO);
+		if (!pages[i])
+			goto fail;
+	}
+	area = vmap(pages, n, VM_MAP, PAGE_KERNEL);
+	if (!area)
+		goto fail;
+
+	if (dev->area)
+		vunmap(dev->area);
+	kvfree(dev->pages);
+	dev->area = area;
+	dev->pages = pages;
+	dev->npages = n;
+	return 0;
+
+fail:
+	while (i-- > dev->npages)
+		__free_page(pages[i]);
+	kvfree(pages);
+	return -ENOMEM;
+}
+
+/* Called with the semaphore held: reads and writes are a plain copy. */
+static ssize_t scullv_flat_read(struct scullv_dev *dev, char __user *buf,
+				size_t count, loff_t *f_pos)
+{
+	if (*f_pos >= dev->size)
+		return 0;
+	if (*f_pos + count > dev->size)
+		count = dev->size - *f_pos;
+	if (copy_to_user(buf, dev->area + *f_pos, count))
+		return -EFAULT;
+	*f_pos += count;
+	return count;
+}
+
+static ssize_t scullv_flat_write(struct scullv_dev *dev, const char __user *buf,
+				 size_t count, loff_t *f_pos)
+{
+	int retval;
+
+	if (*f_pos >= scullv_area)
+		return -ENOSPC;
+	if (*f_pos + count > scullv_area)
+		count = scullv_area - *f_pos;
+	retval = scullv_flat_grow(dev, *f_pos + count);
+	if (retval)
+		return retval;
+	if (copy_from_user(dev->area + *f_pos, buf, count))
+		return -EFAULT;
+	*f_pos += count;
+
+	/* update the size */
+	if (dev->size < *f_pos)
+		dev->size = *f_pos;
+	return count;
+}
+
 /*
  * Data management: read and write
  */
@@ -185,6 +281,11 @@ ssize_t scullv_read(struct file *filp, char __user *buf, size_t count,
 
 	if (down_interruptible(&dev->sem))
 		return -ERESTARTSYS;
+	if (scullv_flat) {
+		retval = scullv_flat_read(dev, buf, count, f_pos);
+		up(&dev->sem);
+		return retval;
+	}
 	if (*f_pos > dev->size)
 		goto nothing;
 	if (*f_pos + count > dev->size)
@@ -233,6 +334,11 @@ ssize_t scullv_write(struct file *filp, const char __user *buf, size_t count,
 
 	if (down_interruptible(&dev->sem))
 		return -ERESTARTSYS;
+	if (scullv_flat) {
+		retval = scullv_flat_write(dev, buf, count, f_pos);
+		up(&dev->sem);
+		return retval;
+	}
 
 	/* find listitem, qset index and offset in the quantum */
 	item = ((long)*f_pos) / itemsize;
@@ -314,29 +420,150 @@ struct file_operations scullv_fops = {
 	.release = scullv_release,
 };
 
-int scullv_trim(struct scullv_dev *dev)
+/*
+ * Trimming. Freeing thousands of vmalloc()ed quanta with the semaphore
+ * held makes every other user of the device wait, so scullv_trim() only
+ * detaches the contents and a worker frees them after the lock is gone.
+ * vfree() only queues an area for the lazy vmap purge, which flushes the
+ * TLBs whenever lazy_max_pages worth of areas piled up, on its own
+ * schedule. The worker purges itself instead, with vm_unmap_aliases(),
+ * once every scullv_trim_batch areas: a trim costs one flush, and one
+ * round of IPIs, per batch, and the worker yields between batches.
+ */
+struct scullv_trash {
+	struct work_struct work;
+	struct scullv_dev head; /* the detached contents */
+};
+
+static struct workqueue_struct *scullv_wq;
+
+static struct scullv_trim_stats {
+	atomic_long_t trims;
+	atomic_long_t areas; /* vmap areas released */
+	atomic_long_t batches; /* each ended by one purge, so one flush */
+	atomic64_t lock_ns; /* time spent detaching, lock held */
+	atomic64_t reap_ns; /* time spent freeing in the background */
+	atomic64_t last_lock_ns;
+	atomic64_t last_reap_ns;
+} scullv_trim_stats;
+
+static void scullv_free_contents(struct scullv_dev *head)
 {
 	struct scullv_dev *next, *dptr;
-	int qset = dev->qset; /* "dev" is not-null */
-	int i;
+	int batch = max(scullv_trim_batch, 1);
+	long areas = 0, batches = 0;
+	unsigned long i;
 
-	for (dptr = dev; dptr; dptr = next) { /* all the list items */
+	for (dptr = head; dptr; dptr = next) { /* all the list items */
 		if (dptr->data) {
-			for (i = 0; i < qset; i++)
-				if (dptr->data[i])
-					vfree(dptr->data[i]);
-
+			for (i = 0; i < head->qset; i++) {
+				if (!dptr->data[i])
+					continue;
+				vfree(dptr->data[i]);
+				if (++areas % batch == 0) {
+					vm_unmap_aliases(); /* one flush */
+					batches++;
+					cond_resched();
+				}
+			}
 			kfree(dptr->data);
-			dptr->data = NULL;
 		}
 		next = dptr->next;
-		if (dptr != dev)
+		if (dptr != head)
 			kfree(dptr); /* all of them but the first */
 	}
+
+	if (head->area) { /* flat mode: a single area */
+		vunmap(head->area);
+		areas++;
+	}
+	if (areas % batch) { /* the last, partial batch */
+		vm_unmap_aliases();
+		batches++;
+	}
+	for (i = 0; i < head->npages; i++) {
+		__free_page(head->pages[i]);
+		if ((i + 1) % ((unsigned long)batch << head->order) == 0)
+			cond_resched();
+	}
+	kvfree(head->pages);
+
+	atomic_long_add(areas, &scullv_trim_stats.areas);
+	atomic_long_add(batches, &scullv_trim_stats.batches);
+}
+
+static void scullv_reap(struct work_struct *work)
+{
+	struct scullv_trash *t = container_of(work, struct scullv_trash, work);
+	u64 t0 = ktime_get_ns(), ns;
+
+	scullv_free_contents(&t->head);
+	kfree(t);
+
+	ns = ktime_get_ns() - t0;
+	atomic64_add(ns, &scullv_trim_stats.reap_ns);
+	atomic64_set(&scullv_trim_stats.last_reap_ns, ns);
+}
+
+static int scullv_trim_show(struct seq_file *s, void *v)
+{
+	struct scullv_trim_stats *st = &scullv_trim_stats;
+
+	seq_printf(s, "trims %li, areas %li, purges %li (batch %i)\n",
+		   atomic_long_read(&st->trims), atomic_long_read(&st->areas),
+		   atomic_long_read(&st->batches), scullv_trim_batch);
+	seq_printf(s, "locked: total %lli ns, last %lli ns\n",
+		   atomic64_read(&st->lock_ns), atomic64_read(&st->last_lock_ns));
+	seq_printf(s, "background: total %lli ns, last %lli ns\n",
+		   atomic64_read(&st->reap_ns), atomic64_read(&st->last_reap_ns));
+	return 0;
+}
+
+static int scullv_trim_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, scullv_trim_show, NULL);
+}
+
+static const struct proc_ops scullv_trim_proc_ops = {
+	.proc_open = scullv_trim_open,
+	.proc_read = seq_read,
+	.proc_lseek = seq_lseek,
+	.proc_release = single_release,
+};
+
+int scullv_trim(struct scullv_dev *dev)
+{
+	struct scullv_trash *t;
+	u64 t0 = ktime_get_ns(), ns;
+
+	t = kmalloc(sizeof(*t), GFP_KERNEL);
+	if (t) {
+		t->head.data = dev->data;
+		t->head.next = dev->next;
+		t->head.qset = dev->qset;
+		t->head.order = dev->order;
+		t->head.area = dev->area;
+		t->head.pages = dev->pages;
+		t->head.npages = dev->npages;
+		INIT_WORK(&t->work, scullv_reap);
+		queue_work(scullv_wq, &t->work);
+	} else {
+		scullv_free_contents(dev); /* no memory: do it the slow way */
+	}
+
+	dev->data = NULL;
+	dev->area = NULL;
+	dev->pages = NULL;
+	dev->npages = 0;
 	dev->size = 0;
 	dev->qset = scullv_qset;
 	dev->order = scullv_order;
 	dev->next = NULL;
+
+	ns = ktime_get_ns() - t0;
+	atomic_long_inc(&scullv_trim_stats.trims);
+	atomic64_add(ns, &scullv_trim_stats.lock_ns);
+	atomic64_set(&scullv_trim_stats.last_lock_ns, ns);
 	return 0;
 }
 
@@ -370,6 +597,12 @@ int scullv_init(void)
 	if (result < 0)
 		return result;
 
+	scullv_wq = alloc_workqueue("scullv_trim", WQ_UNBOUND, 0);
+	if (!scullv_wq) {
+		result = -ENOMEM;
+		goto fail_malloc;
+	}
+
 	/*
 	 * allocate the devices -- we can't have them static, as the number
 	 * can be specified at load time
@@ -378,7 +611,7 @@ int scullv_init(void)
 		kmalloc(scullv_devs * sizeof(struct scullv_dev), GFP_KERNEL);
 	if (!scullv_devices) {
 		result = -ENOMEM;
-		goto fail_malloc;
+		goto fail_devices;
 	}
 	memset(scullv_devices, 0, scullv_devs * sizeof(struct scullv_dev));
 	for (i = 0; i < scullv_devs; i++) {
@@ -391,8 +624,11 @@ int scullv_init(void)
 #ifdef SCULLV_USE_PROC /* only when available */
 	scullv_create_proc();
 #endif
+	proc_create("scullvtrim", 0, NULL, &scullv_trim_proc_ops);
 	return 0; /* succeed */
 
+fail_devices:
+	destroy_workqueue(scullv_wq);
 fail_malloc:
 	unregister_chrdev_region(dev, scullv_devs);
 	return result;
@@ -403,11 +639,13 @@ void scullv_cleanup(void)
 #ifdef SCULLV_USE_PROC
 	scullv_remove_proc();
 #endif
+	remove_proc_entry("scullvtrim", NULL);
 
 	for (int i = 0; i < scullv_devs; i++) {
 		cdev_del(&scullv_devices[i].cdev);
 		scullv_trim(scullv_devices + i);
 	}
+	destroy_workqueue(scullv_wq); /* waits for pending trims */
 	kfree(scullv_devices);
 
 	unregister_chrdev_region(MKDEV(scullv_major, 0), scullv_devs);
@@ -45,12 +45,22 @@
 #define SCULLV_ORDER 0 /* one page at a time */
 #define SCULLV_QSET 500
 
+/*
+ * In "flat" mode the device is instead a single virtually contiguous
+ * area: individually allocated pages vmap()ed together. The area grows
+ * geometrically, at least one quantum at a time, up to SCULLV_AREA bytes.
+ */
+#define SCULLV_AREA (64UL << 20)
+
 struct scullv_dev {
 	void **data;
 	struct scullv_dev *next; /* next listitem */
 	int qset; /* the current array size */
 	int order;
 	size_t size; /* 32-bit will suffice */
+	void *area; /* flat mode: vmap() of "pages" */
+	struct page **pages; /* flat mode: pages backing the area */
+	unsigned long npages; /* flat mode: length of "pages" */
 	struct semaphore sem; /* Mutual exclusion */
 	struct cdev cdev;
 };
@@ -66,6 +76,8 @@ extern int scullv_major; /* main.c */
 extern int scullv_devs;
 extern int scullv_order;
 extern int scullv_qset;
+extern int scullv_flat;
+extern unsigned long scullv_area;
 
 /*
  * Prototypes for shared functions
@@ -1,8 +1,6 @@
 /*
  * shortint.c - Simple Hardware Operations and Raw Tests (w/ interrupts)
  *
- * FIXME - This driver is not safe with concurrent readers/writers.
- *
  * Credit - "Linux Device Drivers" by Alessandro Rubini and Jonathan Corbet,
  * published by O'Reilly and Associates.
  */
@@ -21,8 +19,18 @@
 #include <linux/mm.h>
 #include <linux/ioport.h>
 #include <linux/interrupt.h>
+#include <linux/irq.h> /* dummy_irq_chip, for the simulation */
 #include <linux/workqueue.h>
 #include <linux/wait.h>
+#include <linux/ktime.h>
+#include <linux/mutex.h>
+#include <linux/poll.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h> /* roundup_pow_of_two() */
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/cpumask.h>
+#include <linux/hrtimer.h>
 
 #include <asm/io.h>
 
@@ -58,15 +66,38 @@ module_param(wq, int, 0);
 static int tasklet = 0; /* select whether a tasklet is used */
 module_param(tasklet, int, 0);
 
+static int threaded = 0; /* select whether a threaded irq is used */
+module_param(threaded, int, 0);
+
+static int nr_tv = 512; /* bottom half ring entries, rounded to a power of 2 */
+module_param(nr_tv, int, 0);
+
+static int thread_cpu = -1; /* the cpu the irq, and so its thread, runs on */
+module_param(thread_cpu, int, 0);
+
 static int share = 0; /* select at load time whether install a shared irq */
 module_param(share, int, 0);
 
+static int coalesce = 1; /* events per reader wakeup, 1 wakes for each */
+module_param(coalesce, int, 0);
+
+static int coalesce_us = 1000; /* the longest a partial batch waits */
+module_param(coalesce_us, int, 0);
+
+static int binary = 0; /* select whether the handlers capture binary records */
+module_param(binary, int, 0);
+
+static int pages = 1; /* size of the binary ring, rounded to a power of two */
+module_param(pages, int, 0);
+
+static int sim_rate = 0; /* simulated interrupts per second, 0 for the port */
+module_param(sim_rate, int, 0);
+
 MODULE_AUTHOR("Alessandro Rubini");
 MODULE_LICENSE("Dual BSD/GPL");
 
 unsigned long short_buffer = 0;
-unsigned long volatile short_head;
-volatile unsigned long short_tail;
+static unsigned long short_head; /* bytes written to short_buffer, ever */
 DECLARE_WAIT_QUEUE_HEAD(short_queue);
 
 /* Set up our tasklet if we're doing that. */
@@ -77,13 +108,291 @@ void short_do_work(struct work_struct *w);
 void short_do_thingy(void);
 
 /*
- * Atomicly increment an index into short_buffer
+ * Latency statistics, in /proc/shortint: how long the bottom half took to
+ * see each interrupt, and how long binary mode readers took to get it.
+ * Buckets are powers of two: bucket 0 counts delays under 1us, bucket n
+ * those from 2^(n-1) to 2^n us, the last one everything above.
+ */
+#define SHORT_HIST 16
+
+static unsigned long short_irqs; /* handled by our top halves */
+static unsigned long short_bh_runs;
+static unsigned long short_bh_hist[SHORT_HIST], short_rd_hist[SHORT_HIST];
+
+static void short_hist_add(unsigned long *hist, s64 ns)
+{
+	u64 usecs = ns > 0 ? div_u64(ns, NSEC_PER_USEC) : 0;
+
+	hist[usecs ? min_t(u64, ilog2(usecs) + 1, SHORT_HIST - 1) : 0]++;
+}
+
+/*
+ * Reader wakeups. Waking the readers for every interrupt costs more than
+ * the interrupt itself at high rates, so with coalesce > 1 the handlers
+ * only wake them once "coalesce" events are pending, and an hrtimer
+ * flushes a partial batch coalesce_us after its first event. The
+ * handlers and the timer can race, so the pending count is atomic and
+ * whoever takes it does the wakeup. Only readers that went to sleep
+ * cost a wakeup, and only those are counted.
+ */
+static struct hrtimer short_timer;
+static atomic_t short_pending = ATOMIC_INIT(0);
+static unsigned long short_events; /* the handlers' side only */
+static atomic_long_t short_wakeups = ATOMIC_LONG_INIT(0);
+
+static void short_wake_now(void)
+{
+	if (!atomic_xchg(&short_pending, 0))
+		return;
+	smp_mb(); /* pairs with the one in prepare_to_wait() */
+	if (waitqueue_active(&short_queue)) {
+		atomic_long_inc(&short_wakeups);
+		wake_up_interruptible(&short_queue);
+	}
+}
+
+static enum hrtimer_restart short_timer_fn(struct hrtimer *t)
+{
+	short_wake_now();
+	return HRTIMER_NORESTART;
+}
+
+/* Called by the handlers once n new events are readable */
+static void short_wake(unsigned int n)
+{
+	int pending = atomic_add_return(n, &short_pending);
+
+	short_events += n;
+	if (pending >= coalesce) {
+		if (coalesce > 1)
+			hrtimer_try_to_cancel(&short_timer);
+		short_wake_now();
+	} else if (pending == n) { /* the first of a batch */
+		hrtimer_start(&short_timer, us_to_ktime(coalesce_us),
+			      HRTIMER_MODE_REL);
+	}
+}
+
+/*
+ * The text ring. short_buffer is a page of 16 byte lines, written by one
+ * handler only (the top half without a bottom half, the bottom half
+ * otherwise) and never waiting for the readers: each open file has its
+ * own cursor, so every reader sees every line. A reader that falls a
+ * page behind has lost the oldest lines; it skips to the oldest one left
+ * and reads an "overrun" line telling how many it missed. One line short
+ * of a page is readable, as the next one may be half written.
+ */
+#define SHORT_TEXT_REC 16 /* "%08u.%06u\n" */
+#define SHORT_TEXT_WIN (PAGE_SIZE - SHORT_TEXT_REC)
+
+struct short_reader {
+	struct mutex lock; /* for processes sharing the file */
+	unsigned long pos; /* in the bytes counted by short_head */
+	unsigned long missed; /* lines, not reported yet */
+};
+
+static atomic_t short_nr_readers = ATOMIC_INIT(0);
+static atomic_long_t short_overruns = ATOMIC_LONG_INIT(0);
+
+/* Append a line of exactly SHORT_TEXT_REC bytes */
+static __printf(1, 2) void short_text_put(const char *fmt, ...)
+{
+	char rec[SHORT_TEXT_REC + 1]; /* vsnprintf() adds a NUL */
+	unsigned long head = short_head;
+	va_list args;
+
+	va_start(args, fmt);
+	vsnprintf(rec, sizeof(rec), fmt, args);
+	va_end(args);
+	/* a reader that saw the line change must see head move past it */
+	smp_wmb();
+	memcpy((char *)short_buffer + (head & (PAGE_SIZE - 1)), rec,
+	       SHORT_TEXT_REC);
+	smp_store_release(&short_head, head + SHORT_TEXT_REC);
+}
+
+/*
+ * Binary capture. Instead of formatting text, the handlers store one
+ * record per interrupt in a ring of short_nr_recs records, which
+ * follows a control page holding the indices. The handler is the only
+ * producer, and the consumer is either a process that mapped the ring
+ * (minor 129 can be mmap()ed) or readers of one open file, serialized by
+ * short_read_lock. There is one consumer at a time: the producer only
+ * knows one tail, so a second open for reading fails with -EBUSY until
+ * the first file is released, mappings included.
+ *
+ * The indices are free running and published with release/acquire
+ * ordering, so neither side takes a lock against the other. When the
+ * ring is full the interrupt is counted in "lost" and its sequence
+ * number is skipped, so readers see the gap.
+ *
+ * Minor 128 reads the records as text, as it always did; minor 129 reads
+ * them raw, as struct short_rec; only one of them is open for reading.
+ */
+struct short_rec {
+	u64 ns; /* ktime_get_ns() when the interrupt was handled */
+	u32 seq; /* interrupt number, counting the lost ones */
+	u32 flags; /* none yet, always 0 */
+};
+
+/*
+ * The control page. A mapping sees it at offset 0, and the records at
+ * offset PAGE_SIZE. The handler owns head, seq and lost, the consumer
+ * owns tail, on a cache line of its own.
  */
-static inline void short_incr_bp(volatile unsigned long *index, int delta)
+struct short_ctl {
+	u32 head;
+	u32 seq; /* of the next interrupt */
+	u32 lost; /* interrupts that found the ring full */
+	u32 nr_recs; /* the size of the ring, a power of two */
+	u32 tail __attribute__((aligned(64)));
+};
+
+static struct short_ctl *short_ctl; /* and the ring after it */
+static struct short_rec *short_recs;
+static unsigned int short_nr_recs;
+static DEFINE_MUTEX(short_read_lock);
+static unsigned long short_rec_busy; /* bit 0: the consumer's file is open */
+
+/* Called by the handlers, in interrupt context */
+static void short_capture(void)
 {
-	unsigned long new = *index + delta;
-	barrier(); /* Don't optimize these two together */
-	*index = (new >= (short_buffer + PAGE_SIZE)) ? short_buffer : new;
+	u64 ns = ktime_get_ns();
+	unsigned int head = short_ctl->head;
+	struct short_rec *rec;
+
+	short_irqs++;
+	/* a mapping may have left anything in tail: trust nothing */
+	if (head - smp_load_acquire(&short_ctl->tail) >= short_nr_recs) {
+		short_ctl->lost++; /* full: the reader is too slow */
+		short_ctl->seq++;
+		return;
+	}
+	rec = &short_recs[head & (short_nr_recs - 1)];
+	rec->ns = ns;
+	rec->seq = short_ctl->seq++;
+	rec->flags = 0;
+	smp_store_release(&short_ctl->head, head + 1);
+	short_wake(1);
+}
+
+/*
+ * Copy whole records to user space, raw or as text, starting at the
+ * free running index "tail". Returns how many bytes were copied.
+ */
+static ssize_t short_rec_copy(char __user *buf, unsigned int tail,
+			      unsigned int n, int raw)
+{
+	char text[16 * SHORT_TEXT_REC + 1]; /* snprintf() adds a NUL */
+	struct short_rec *rec;
+	unsigned int i, len, done = 0;
+	u64 sec, to_real;
+	u32 nsec;
+
+	if (raw) {
+		/* both sides of the wrap */
+		i = min(n, short_nr_recs - (tail & (short_nr_recs - 1)));
+		if (copy_to_user(buf, &short_recs[tail & (short_nr_recs - 1)],
+				 i * sizeof(*rec)) ||
+		    copy_to_user(buf + i * sizeof(*rec), short_recs,
+				 (n - i) * sizeof(*rec)))
+			return -EFAULT;
+		return n * sizeof(*rec);
+	}
+
+	/*
+	 * The text has always shown the time of day, so move the records
+	 * from the monotonic clock to the real one. The offset is the current
+	 * one: a clock set since the interrupt shifts the old lines with it.
+	 */
+	to_real = ktime_to_ns(ktime_mono_to_real(0));
+	while (n) {
+		for (i = 0, len = 0; i < 16 && i < n; i++) {
+			rec = &short_recs[(tail + i) & (short_nr_recs - 1)];
+			sec = div_u64_rem(rec->ns + to_real, NSEC_PER_SEC,
+					  &nsec);
+			len += snprintf(text + len, sizeof(text) - len,
+					"%08u.%06u\n",
+					(unsigned int)do_div(sec, 100000000),
+					nsec / NSEC_PER_USEC);
+		}
+		if (copy_to_user(buf + done, text, len))
+			return done ? done : -EFAULT;
+		done += len;
+		tail += i;
+		n -= i;
+	}
+	return done;
+}
+
+static ssize_t short_rec_read(struct file *filp, char __user *buf,
+			      size_t count)
+{
+	int raw = iminor(file_inode(filp)) & 1;
+	size_t recsize = raw ? sizeof(struct short_rec) : SHORT_TEXT_REC;
+	unsigned int head, tail, n;
+	ssize_t ret;
+
+	if (count < recsize)
+		return -EINVAL; /* whole records only */
+	if (mutex_lock_interruptible(&short_read_lock))
+		return -ERESTARTSYS;
+	tail = short_ctl->tail;
+	while ((head = smp_load_acquire(&short_ctl->head)) == tail) {
+		mutex_unlock(&short_read_lock);
+		if (filp->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if (wait_event_interruptible(
+			    short_queue,
+			    smp_load_acquire(&short_ctl->head) != tail))
+			return -ERESTARTSYS; /* tell the fs layer to handle it */
+		if (mutex_lock_interruptible(&short_read_lock))
+			return -ERESTARTSYS;
+		tail = short_ctl->tail; /* another reader may have been first */
+	}
+
+	n = min_t(size_t, count / recsize,
+		  min(head - tail, short_nr_recs)); /* tail may be garbage */
+	ret = short_rec_copy(buf, tail, n, raw);
+	if (ret > 0) { /* a partial text copy frees the records it copied */
+		/* the oldest record read waited the longest */
+		short_hist_add(short_rd_hist, ktime_get_ns() -
+			       short_recs[tail & (short_nr_recs - 1)].ns);
+		smp_store_release(&short_ctl->tail, tail + ret / recsize);
+	}
+	mutex_unlock(&short_read_lock);
+	return ret;
+}
+
+/* For mapped consumers, and text readers: sleep until there is data */
+static __poll_t short_rec_poll(struct file *filp, poll_table *wait)
+{
+	struct short_reader *r = filp->private_data;
+
+	poll_wait(filp, &short_queue, wait);
+	smp_mb(); /* as in prepare_to_wait() */
+	if (!(filp->f_mode & FMODE_READ))
+		return 0; /* write-only: there is no cursor to compare */
+	if (!binary) /* no lock: a stale cursor only means a spurious poll */
+		return READ_ONCE(short_head) != READ_ONCE(r->pos) ?
+			       EPOLLIN | EPOLLRDNORM : 0;
+	if (smp_load_acquire(&short_ctl->head) != READ_ONCE(short_ctl->tail))
+		return EPOLLIN | EPOLLRDNORM;
+	return 0;
+}
+
+/*
+ * Map the control page and the ring. The mapping holds a reference to
+ * the file and the ring stays until the module goes, so nothing else
+ * has to be tracked.
+ */
+static int short_rec_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	if (!binary)
+		return -ENODEV;
+	if (!(vma->vm_flags & VM_SHARED))
+		return -EINVAL; /* a private copy would see nothing new */
+	return remap_vmalloc_range(vma, short_ctl, vma->vm_pgoff);
 }
 
 /*
@@ -91,46 +400,112 @@ static inline void short_incr_bp(volatile unsigned long *index, int delta)
  * specific I/O ports (by default the parallel ones).
  *
  * The device with 128 as minor number returns ascii strings telling
- * when interrupts have been received. Writing to the device toggles
- * 00/FF on the parallel data lines. If there is a loopback wire, this
- * generates interrupts.
+ * when interrupts have been received, to every reader that opened it.
+ * Writing to the device toggles 00/FF on the parallel data lines. If
+ * there is a loopback wire, this generates interrupts.
  */
 
 int short_open(struct inode *inode, struct file *filp)
 {
+	struct short_reader *r;
+	unsigned long head;
+
+	if ((iminor(inode) & 1) && !binary)
+		return -ENODEV; /* raw records need binary mode */
+	if (binary) { /* the binary ring has a single consumer */
+		if ((filp->f_mode & FMODE_READ) &&
+		    test_and_set_bit(0, &short_rec_busy))
+			return -EBUSY;
+		return 0;
+	}
+	if (!(filp->f_mode & FMODE_READ))
+		return 0; /* a writer needs no cursor */
+
+	r = kmalloc(sizeof(*r), GFP_KERNEL);
+	if (!r)
+		return -ENOMEM;
+	mutex_init(&r->lock);
+	/* start with what is still there, as a lone reader always did */
+	head = smp_load_acquire(&short_head);
+	r->pos = head > SHORT_TEXT_WIN ? head - SHORT_TEXT_WIN : 0;
+	r->missed = 0;
+	filp->private_data = r;
+	atomic_inc(&short_nr_readers);
 	return 0;
 }
 
 int short_release(struct inode *inode, struct file *filp)
 {
+	if (binary && (filp->f_mode & FMODE_READ))
+		clear_bit(0, &short_rec_busy);
+	if (!binary && (filp->f_mode & FMODE_READ)) {
+		kfree(filp->private_data);
+		atomic_dec(&short_nr_readers);
+	}
 	return 0;
 }
 
 ssize_t short_i_read(struct file *filp, char __user *buf, size_t count,
 		     loff_t *f_pos)
 {
-	int count0;
-	DEFINE_WAIT(wait);
-
-	while (short_head == short_tail) {
-		prepare_to_wait(&short_queue, &wait, TASK_INTERRUPTIBLE);
-		if (short_head == short_tail)
-			schedule();
-		finish_wait(&short_queue, &wait);
-		if (signal_pending(current)) /* a signal arrived */
+	struct short_reader *r = filp->private_data;
+	char note[SHORT_TEXT_REC + 1];
+	unsigned long head, pos;
+	size_t n;
+
+	if (binary)
+		return short_rec_read(filp, buf, count);
+
+	if (mutex_lock_interruptible(&r->lock))
+		return -ERESTARTSYS;
+	while ((head = smp_load_acquire(&short_head)) == r->pos) {
+		mutex_unlock(&r->lock);
+		if (filp->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if (wait_event_interruptible(
+			    short_queue,
+			    smp_load_acquire(&short_head) != READ_ONCE(r->pos)))
 			return -ERESTARTSYS; /* tell the fs layer to handle it */
+		if (mutex_lock_interruptible(&r->lock))
+			return -ERESTARTSYS;
+	}
+
+again:
+	pos = r->pos;
+	if (head - pos > SHORT_TEXT_WIN) { /* overrun: skip what is gone */
+		r->missed += DIV_ROUND_UP(head - SHORT_TEXT_WIN - pos,
+					  SHORT_TEXT_REC);
+		r->pos = pos = head - SHORT_TEXT_WIN;
+	}
+	if (r->missed && count >= SHORT_TEXT_REC) {
+		/* a line of its own, before the ones that follow the gap */
+		snprintf(note, sizeof(note), "overrun %7lu\n",
+			 min(r->missed, 9999999UL));
+		if (copy_to_user(buf, note, SHORT_TEXT_REC)) {
+			mutex_unlock(&r->lock);
+			return -EFAULT;
+		}
+		atomic_long_add(r->missed, &short_overruns);
+		r->missed = 0;
+		mutex_unlock(&r->lock);
+		return SHORT_TEXT_REC;
 	}
-	/* count0 is the number of readable data bytes */
-	count0 = short_head - short_tail;
-	if (count0 < 0) /* wrapped */
-		count0 = short_buffer + PAGE_SIZE - short_tail;
-	if (count0 < count)
-		count = count0;
 
-	if (copy_to_user(buf, (char *)short_tail, count))
+	/* up to the end of the page; the next read gets the rest */
+	n = min3(count, (size_t)(head - pos),
+		 (size_t)(PAGE_SIZE - (pos & (PAGE_SIZE - 1))));
+	if (copy_to_user(buf, (char *)short_buffer + (pos & (PAGE_SIZE - 1)),
+			 n)) {
+		mutex_unlock(&r->lock);
 		return -EFAULT;
-	short_incr_bp(&short_tail, count);
-	return count;
+	}
+	smp_rmb(); /* the copy before the check, pairs with short_text_put() */
+	head = READ_ONCE(short_head);
+	if (head - pos > SHORT_TEXT_WIN)
+		goto again; /* lapped while copying: what we got may be torn */
+	r->pos = pos + n;
+	mutex_unlock(&r->lock);
+	return n;
 }
 
 ssize_t short_i_write(struct file *filp, const char __user *buf, size_t count,
@@ -140,6 +515,8 @@ ssize_t short_i_write(struct file *filp, const char __user *buf, size_t count,
 	unsigned long port = short_base; /* output to the parallel data latch */
 	void *address = (void *)short_base;
 
+	if (sim_rate)
+		return -ENODEV; /* no data lines to toggle */
 	if (use_mem) {
 		while (written < count)
 			iowrite8(0xff * ((++written + odd) & 1), address);
@@ -156,6 +533,8 @@ struct file_operations short_i_fops = {
 	.owner = THIS_MODULE,
 	.read = short_i_read,
 	.write = short_i_write,
+	.poll = short_rec_poll,
+	.mmap = short_rec_mmap,
 	.open = short_open,
 	.release = short_release,
 };
@@ -163,45 +542,55 @@ struct file_operations short_i_fops = {
 irqreturn_t short_interrupt(int irq, void *dev_id)
 {
 	struct timespec64 tv;
-	int written;
 
+	if (binary) {
+		short_capture();
+		return IRQ_HANDLED;
+	}
+
+	short_irqs++;
 	ktime_get_real_ts64(&tv);
 
 	/* Write a 16 byte record. Assume PAGE_SIZE is a multiple of 16 */
-	written = sprintf((char *)short_head, "%08u.%06u\n",
-			  (int)(tv.tv_sec % 100000000),
-			  (int)(tv.tv_nsec) / 1000);
-	BUG_ON(written != 16);
-	short_incr_bp(&short_head, written);
-	wake_up_interruptible(&short_queue); /* awake any reading process */
+	short_text_put("%08u.%06u\n", (int)(tv.tv_sec % 100000000),
+		       (int)(tv.tv_nsec) / 1000);
+	short_wake(1); /* awake any reading process */
 	return IRQ_HANDLED;
 }
 
 /*
  * The following two functions are equivalent to the previous one,
- * but split in top and bottom half. First, a few needed variables
+ * but split in top and bottom half. First, a few needed variables.
+ *
+ * The top half is the only producer of tv_data and the bottom half the
+ * only consumer: the irq isn't reentered, and neither a work item, a
+ * tasklet nor an irq thread runs twice at once. So the free running
+ * indices need no lock, only release/acquire ordering, as in the binary
+ * ring. When the bottom half falls nr_tv interrupts behind, the new ones
+ * are counted in short_tv_lost instead of overwriting the old ones.
  */
-
-#define NR_TIMEVAL 512 /* length of the array of time values */
-
-struct timespec64 tv_data[NR_TIMEVAL]; /* too lazy to allocate it */
-volatile struct timespec64 *tv_head = tv_data;
-volatile struct timespec64 *tv_tail = tv_data;
+static struct timespec64 *tv_data;
+static unsigned int short_nr_tv; /* a power of two */
+static unsigned int short_tv_head, short_tv_tail;
+static unsigned long short_tv_lost;
 
 static struct work_struct short_wq;
 
-int short_wq_count = 0;
+static atomic_t short_wq_count = ATOMIC_INIT(0);
 
-/*
- * Increment a circular buffer pointer in a way that nobody sees
- * an intermediate value.
- */
-static inline void short_incr_tv(volatile struct timespec64 **tvp)
+/* Called by the top halves, in interrupt context */
+static void short_tv_push(void)
 {
-	if (*tvp == (tv_data + NR_TIMEVAL - 1))
-		*tvp = tv_data; /* Wrap */
-	else
-		(*tvp)++;
+	unsigned int head = short_tv_head;
+
+	atomic_inc(&short_wq_count); /* record that an interrupt arrived */
+	short_irqs++;
+	if (head - smp_load_acquire(&short_tv_tail) >= short_nr_tv) {
+		short_tv_lost++; /* full: the bottom half is too slow */
+		return;
+	}
+	ktime_get_real_ts64(&tv_data[head & (short_nr_tv - 1)]);
+	smp_store_release(&short_tv_head, head + 1);
 }
 
 void short_do_tasklet(struct tasklet_struct *t)
@@ -216,8 +605,17 @@ void short_do_work(struct work_struct *w)
 
 void short_do_thingy(void)
 {
-	int savecount = short_wq_count, written;
-	short_wq_count = 0; /* we have already been removed from the queue */
+	unsigned int head, tail = short_tv_tail, first = tail;
+	struct timespec64 *tv;
+	int savecount;
+	u64 now;
+
+	/* we have already been removed from the queue */
+	savecount = atomic_xchg(&short_wq_count, 0);
+	head = smp_load_acquire(&short_tv_head);
+	if (head == tail)
+		return; /* an earlier run took these, or they were lost */
+
 	/*
 	 * The bottom half reads the tv array, filled by the top half,
 	 * and prints it to the circular text buffer, which is then consumed
@@ -225,35 +623,38 @@ void short_do_thingy(void)
 	 */
 
 	/* First write the number of interrupts that occurred before this bh */
-	written = sprintf((char *)short_head, "bh after %6i\n", savecount);
-	short_incr_bp(&short_head, written);
+	short_text_put("bh after %6i\n", min(savecount, 999999));
 
 	/*
 	 * Then, write the time values. Write exactly 16 bytes at a time,
-	 * so it aligns with PAGE_SIZE
+	 * so it aligns with PAGE_SIZE. Entries are given back a batch at
+	 * a time, and whatever arrived meanwhile makes the next batch.
 	 */
-
+	short_bh_runs++;
 	do {
-		written = sprintf((char *)short_head, "%08u.%06u\n",
-				  (int)(tv_tail->tv_sec % 100000000),
-				  (int)(tv_tail->tv_nsec) / 1000);
-		short_incr_bp(&short_head, written);
-		short_incr_tv(&tv_tail);
-	} while (tv_tail != tv_head);
+		now = ktime_get_real_ns();
+		for (; tail != head; tail++) {
+			tv = &tv_data[tail & (short_nr_tv - 1)];
+			short_hist_add(short_bh_hist,
+				       now - timespec64_to_ns(tv));
+			short_text_put("%08u.%06u\n",
+				       (int)(tv->tv_sec % 100000000),
+				       (int)(tv->tv_nsec) / 1000);
+		}
+		smp_store_release(&short_tv_tail, tail);
+		head = smp_load_acquire(&short_tv_head);
+	} while (head != tail);
 
-	wake_up_interruptible(&short_queue); /* awake any reading process */
+	short_wake(tail - first); /* awake any reading process */
 }
 
 irqreturn_t short_wq_interrupt(int irq, void *dev_id)
 {
 	/* Grab the current time information. */
-	ktime_get_real_ts64((struct timespec64 *)tv_head);
-	short_incr_tv(&tv_head);
+	short_tv_push();
 
 	/* Queue the bh. Don't worry about multiple enqueueing */
 	schedule_work(&short_wq);
-
-	short_wq_count++; /* record that an interrupt arrived */
 	return IRQ_HANDLED;
 }
 
@@ -263,18 +664,32 @@ irqreturn_t short_wq_interrupt(int irq, void *dev_id)
 
 irqreturn_t short_tl_interrupt(int irq, void *dev_id)
 {
-	ktime_get_real_ts64(
-		(struct timespec64 *)
-			tv_head); /* cast to stop 'volatile' warning */
-	short_incr_tv(&tv_head);
+	short_tv_push();
 	tasklet_schedule(&short_tasklet);
-	short_wq_count++; /* record that an interrupt arrived */
+	return IRQ_HANDLED;
+}
+
+/*
+ * Threaded irq: the top half is the same, and the core wakes our own
+ * irq thread to run the bottom half. Unlike the workqueue, the thread
+ * serves nobody else; it runs SCHED_FIFO at MAX_RT_PRIO/2 by default,
+ * which chrt can change, and on the cpus the irq is affine to.
+ */
+irqreturn_t short_th_interrupt(int irq, void *dev_id)
+{
+	short_tv_push();
+	return IRQ_WAKE_THREAD;
+}
+
+irqreturn_t short_irq_thread(int irq, void *dev_id)
+{
+	short_do_thingy();
 	return IRQ_HANDLED;
 }
 
 irqreturn_t short_sh_interrupt(int irq, void *dev_id)
 {
-	int value, written;
+	int value;
 	struct timespec64 tv;
 
 	/* If it wasn't short, return immediately */
@@ -287,15 +702,142 @@ irqreturn_t short_sh_interrupt(int irq, void *dev_id)
 
 	/* the rest is unchanged */
 
+	if (binary) {
+		short_capture();
+		return IRQ_HANDLED;
+	}
+
+	short_irqs++;
 	ktime_get_real_ts64(&tv);
-	written = sprintf((char *)short_head, "%08u.%06u\n",
-			  (int)(tv.tv_sec % 100000000),
-			  (int)(tv.tv_nsec) / 1000);
-	short_incr_bp(&short_head, written);
-	wake_up_interruptible(&short_queue); /* awake any reading process */
+	short_text_put("%08u.%06u\n", (int)(tv.tv_sec % 100000000),
+		       (int)(tv.tv_nsec) / 1000);
+	short_wake(1); /* awake any reading process */
 	return IRQ_HANDLED;
 }
 
+/*
+ * Simulated interrupts, for machines without a parallel port and a
+ * loopback wire, like QEMU. With sim_rate set, short_irq is a fresh irq
+ * of our own on the dummy chip, requested with the usual handlers, and
+ * an hrtimer raises it sim_rate times a second through the genirq
+ * core, in hard interrupt context, so the threaded mode gets a real
+ * irq thread. The timer ticks at most every SHORT_SIM_TICK ns, raising
+ * as many interrupts as the rate asks for each time; when it runs late
+ * it catches up, up to SHORT_SIM_BURST at once, and counts the rest as
+ * missed: then the machine can't sustain the rate.
+ */
+#define SHORT_SIM_MAX 10000000 /* interrupts per second */
+#define SHORT_SIM_TICK 10000
+#define SHORT_SIM_BURST 1024
+
+static struct hrtimer short_sim_timer;
+static ktime_t short_sim_period;
+static unsigned int short_sim_batch; /* interrupts per period */
+static unsigned long short_sim_fired, short_sim_missed;
+static unsigned long short_sim_hist[SHORT_HIST];
+static int short_sim_irq = -1; /* ours to free, even if request_irq() failed */
+
+static enum hrtimer_restart short_sim_fn(struct hrtimer *t)
+{
+	u64 n;
+
+	short_hist_add(short_sim_hist,
+		       ktime_to_ns(ktime_sub(ktime_get(),
+					     hrtimer_get_expires(t))));
+	n = hrtimer_forward_now(t, short_sim_period) * short_sim_batch;
+	if (n > SHORT_SIM_BURST) {
+		short_sim_missed += n - SHORT_SIM_BURST;
+		n = SHORT_SIM_BURST;
+	}
+	short_sim_fired += n;
+	while (n--)
+		generic_handle_irq(short_irq);
+	return HRTIMER_RESTART;
+}
+
+static int short_sim_alloc(void)
+{
+	int irq = irq_alloc_desc(NUMA_NO_NODE);
+
+	if (irq < 0)
+		return irq;
+	irq_set_chip_and_handler(irq, &dummy_irq_chip, handle_simple_irq);
+	irq_clear_status_flags(irq, IRQ_NOREQUEST | IRQ_NOPROBE);
+	return irq;
+}
+
+static void short_show_hist(struct seq_file *s, const char *what,
+			    unsigned long *hist)
+{
+	int b;
+
+	seq_printf(s, "%s (us, log2 buckets):", what);
+	for (b = 0; b < SHORT_HIST; b++)
+		seq_printf(s, " %lu", hist[b]);
+	seq_putc(s, '\n');
+}
+
+/* lost interrupts, and their share of all of them in hundredths of % */
+static void short_show_lost(struct seq_file *s, unsigned long lost)
+{
+	u64 rate = short_irqs ? div64_u64((u64)lost * 10000, short_irqs) : 0;
+
+	seq_printf(s, "lost: %lu (%llu.%02llu%%)\n", lost,
+		   div_u64(rate, 100), rate % 100);
+}
+
+static int short_proc_show(struct seq_file *s, void *v)
+{
+	unsigned long wakeups;
+	u64 rate;
+
+	seq_printf(s, "mode: %s%s\n",
+		   threaded ? "threaded irq" : tasklet ? "tasklet" :
+		   wq ? "workqueue" : share ? "shared irq" : "irq",
+		   binary ? ", binary" : "");
+	if (sim_rate) {
+		seq_printf(s, "generator: %i/s, fired %lu, missed %lu\n",
+			   sim_rate, short_sim_fired, short_sim_missed);
+		short_show_hist(s, "timer to irq", short_sim_hist);
+	}
+	seq_printf(s, "interrupts: %lu\n", short_irqs);
+	if (binary)
+		short_show_lost(s, READ_ONCE(short_ctl->lost));
+	if (wq || tasklet || threaded) {
+		seq_printf(s, "ring: %u entries, %u pending\n", short_nr_tv,
+			   READ_ONCE(short_tv_head) - READ_ONCE(short_tv_tail));
+		short_show_lost(s, READ_ONCE(short_tv_lost));
+		seq_printf(s, "bottom half runs: %lu\n", short_bh_runs);
+		short_show_hist(s, "irq to bottom half", short_bh_hist);
+	}
+	if (binary)
+		short_show_hist(s, "irq to read", short_rd_hist);
+	else
+		seq_printf(s, "readers: %i, lines overrun: %lu\n",
+			   atomic_read(&short_nr_readers),
+			   atomic_long_read(&short_overruns));
+	wakeups = atomic_long_read(&short_wakeups);
+	/* in hundredths, as the loss rate */
+	rate = wakeups ? div64_u64((u64)short_events * 100, wakeups) : 0;
+	seq_printf(s, "wakeups: %lu, coalescing %i or %ius, "
+		      "%llu.%02llu events each\n",
+		   wakeups, coalesce, coalesce_us, div_u64(rate, 100),
+		   rate % 100);
+	return 0;
+}
+
+static int short_proc_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, short_proc_show, NULL);
+}
+
+static const struct proc_ops short_proc_ops = {
+	.proc_open = short_proc_open,
+	.proc_read = seq_read,
+	.proc_lseek = seq_lseek,
+	.proc_release = single_release,
+};
+
 void short_kernelprobe(void)
 {
 	int count = 0;
@@ -325,30 +867,46 @@ void short_kernelprobe(void)
 		printk("shortint: probe failed %i times, giving up\n", count);
 }
 
+/* Give back what short_init() got to reach the port */
+static void short_put_ports(void)
+{
+	if (sim_rate)
+		return; /* there was none */
+	if (use_mem) {
+		iounmap((void __iomem *)short_base);
+		release_mem_region(short_base, SHORT_NR_PORTS);
+	} else {
+		release_region(short_base, SHORT_NR_PORTS);
+	}
+}
+
 void short_cleanup(void)
 {
+	hrtimer_cancel(&short_sim_timer); /* no more simulated interrupts */
 	if (short_irq >= 0) {
-		outb(0x0, short_base + 2); /* disable the interrupt */
+		if (!sim_rate)
+			outb(0x0, short_base + 2); /* disable the interrupt */
 		if (!share)
 			free_irq(short_irq, NULL);
 		else
 			free_irq(short_irq, short_sh_interrupt);
 	}
+	if (short_sim_irq >= 0)
+		irq_free_desc(short_sim_irq);
 	/* Make sure we don't leave work queue/tasklet functions running */
 	if (tasklet)
 		tasklet_disable(&short_tasklet);
 	else
 		flush_scheduled_work();
+	hrtimer_cancel(&short_timer);
 
+	remove_proc_entry("shortint", NULL);
 	unregister_chrdev(major, "shortint");
-	if (use_mem) {
-		iounmap((void __iomem *)short_base);
-		release_mem_region(short_base, SHORT_NR_PORTS);
-	} else {
-		release_region(short_base, SHORT_NR_PORTS);
-	}
+	short_put_ports();
 	if (short_buffer)
 		free_page(short_buffer);
+	vfree(short_ctl);
+	kvfree(tv_data);
 }
 
 int short_init(void)
@@ -363,8 +921,23 @@ int short_init(void)
 	short_base = base;
 	short_irq = irq;
 
+	/* before anything can fail: short_cleanup() cancels the timer */
+	coalesce = max(coalesce, 1);
+	coalesce_us = clamp(coalesce_us, 1, (int)USEC_PER_SEC);
+	hrtimer_init(&short_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	short_timer.function = short_timer_fn;
+	sim_rate = clamp(sim_rate, 0, SHORT_SIM_MAX);
+	hrtimer_init(&short_sim_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_HARD);
+	short_sim_timer.function = short_sim_fn;
+	if (sim_rate && share) {
+		printk(KERN_INFO "shortint: no shared irq in simulation\n");
+		share = 0; /* its handler reads the port */
+	}
+
 	/* Get our needed resources. */
-	if (!use_mem) {
+	if (sim_rate) {
+		/* nothing: the handlers won't touch the port */
+	} else if (!use_mem) {
 		if (!request_region(short_base, SHORT_NR_PORTS, "shortint")) {
 			printk(KERN_INFO
 			       "shortint: can't get I/O port address 0x%lx\n",
@@ -389,22 +962,49 @@ int short_init(void)
 	result = register_chrdev(major, "shortint", &short_i_fops);
 	if (result < 0) {
 		printk(KERN_INFO "shortint: can't get major number\n");
-		if (!use_mem) {
-			release_region(short_base, SHORT_NR_PORTS);
-		} else {
-			release_mem_region(short_base, SHORT_NR_PORTS);
-		}
+		short_put_ports();
 		return result;
 	}
 	if (major == 0)
 		major = result; /* dynamic */
+	proc_create("shortint", 0, NULL, &short_proc_ops);
 
 	short_buffer = __get_free_pages(GFP_KERNEL, 0);
 	if (!short_buffer) {
 		printk(KERN_INFO "shortint: can't allocate buffer page\n");
 		short_cleanup();
 	}
-	short_head = short_tail = short_buffer;
+
+	/* the bottom halves format their own text */
+	if (binary && (wq || tasklet || threaded)) {
+		printk(KERN_INFO
+		       "shortint: no binary capture with bottom halves\n");
+		binary = 0;
+	}
+	if (binary) {
+		pages = roundup_pow_of_two(clamp(pages, 1, 1024));
+		/* zeroed, and mappable with remap_vmalloc_range() */
+		short_ctl = vmalloc_user((1 + pages) * PAGE_SIZE);
+		if (!short_ctl) {
+			printk(KERN_INFO "shortint: can't allocate the ring\n");
+			binary = 0;
+		} else {
+			short_nr_recs = pages * PAGE_SIZE /
+					sizeof(struct short_rec);
+			short_ctl->nr_recs = short_nr_recs;
+			short_recs = (void *)short_ctl + PAGE_SIZE;
+		}
+	}
+
+	if (wq || tasklet || threaded) {
+		short_nr_tv = roundup_pow_of_two(clamp(nr_tv, 16, 1 << 16));
+		tv_data = kvcalloc(short_nr_tv, sizeof(*tv_data), GFP_KERNEL);
+		if (!tv_data) {
+			printk(KERN_INFO "shortint: can't allocate the "
+					 "bottom half ring\n");
+			wq = tasklet = threaded = 0; /* plain handler */
+		}
+	}
 
 	/*
 	 * Fill the workqueue structure, used for the bottom half handler.
@@ -419,6 +1019,16 @@ int short_init(void)
 	 * autodetection, DIY detection or default number
 	 */
 
+	if (sim_rate) {
+		short_irq = short_sim_irq = short_sim_alloc();
+		if (short_irq < 0) {
+			result = short_irq;
+			printk(KERN_INFO "shortint: can't allocate an irq\n");
+			short_cleanup();
+			return result;
+		}
+	}
+
 	if (short_irq < 0 && probe == 1)
 		short_kernelprobe();
 
@@ -462,7 +1072,8 @@ int short_init(void)
 			       "shortint: can't get assigned irq %i\n",
 			       short_irq);
 			short_irq = -1;
-		} else { /* actually enable it -- assume this *is* a parallel port */
+		} else if (!sim_rate) {
+			/* actually enable it -- assume this *is* a parport */
 			outb(0x10, short_base + 2);
 		}
 	}
@@ -471,12 +1082,18 @@ int short_init(void)
 	 * Ok, now change the interrupt handler if using top/bottom halves
 	 * has been requested
 	 */
-	if (short_irq >= 0 && (wq + tasklet) > 0) {
+	if (short_irq >= 0 && (wq + tasklet + threaded) > 0) {
 		free_irq(short_irq, NULL);
-		result = request_irq(short_irq,
-				     tasklet ? short_tl_interrupt :
-					       short_wq_interrupt,
-				     0, "short-bh", NULL);
+		if (threaded)
+			result = request_threaded_irq(short_irq,
+						      short_th_interrupt,
+						      short_irq_thread, 0,
+						      "short-bh", NULL);
+		else
+			result = request_irq(short_irq,
+					     tasklet ? short_tl_interrupt :
+						       short_wq_interrupt,
+					     0, "short-bh", NULL);
 		if (result) {
 			printk(KERN_INFO
 			       "short-bh: can't get assigned irq %i\n",
@@ -485,6 +1102,24 @@ int short_init(void)
 		}
 	}
 
+	/* the irq thread follows the affinity of its irq */
+	if (short_irq >= 0 && threaded && thread_cpu >= 0) {
+		if (thread_cpu >= nr_cpu_ids || !cpu_online(thread_cpu) ||
+		    irq_set_affinity(short_irq, cpumask_of(thread_cpu)))
+			printk(KERN_INFO
+			       "shortint: can't pin irq %i to cpu %i\n",
+			       short_irq, thread_cpu);
+	}
+
+	if (short_irq >= 0 && sim_rate) {
+		short_sim_batch = DIV_ROUND_UP_ULL(
+			(u64)sim_rate * SHORT_SIM_TICK, NSEC_PER_SEC);
+		short_sim_period = ns_to_ktime(div_u64((u64)short_sim_batch *
+						       NSEC_PER_SEC, sim_rate));
+		hrtimer_start(&short_sim_timer, short_sim_period,
+			      HRTIMER_MODE_REL_HARD);
+	}
+
 	return 0;
 }
 